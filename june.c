@@ -1,53 +1,399 @@
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
-#include <ctype.h>
+#include <time.h>
+
+#include "june.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define JUNE_X86
+  #include <immintrin.h>
+#endif
 
 #define JUNE_VERSION "June 1.2 rev 0"
 
 #define JUNE_USAGE "Usage: june [opts] [-f <file>] [rules]\n"
 #define JUNE_FILE  "jfile"
+#define JUNE_LOG   ".june_log"
 
 #define MAX_RULES 256
 #define MAX_VARS  1024
+#define MAX_OUTS  64
+
+#define PATERN_CHAIN_MAX 8
+
+#define SCAN_THREADS 32
+
+#define OUTPUT_RING  (64 * 1024)
+#define OUTPUT_QUIET (4 * 1024)
 
 
 typedef struct {
     int is_patern;
+    int restat;
     union {
         char *name;
         struct {
             char *src_ext;
             char *dst_ext;
+            char *odir;     // "" or output directory with its '/'
         } patern;
     };
+    char **outs;        // explicit rules, outs[0] is name
     char **deps;
     char **cmds;
 } rule_t;
 
+typedef struct {
+    char **items;       // NULL terminated
+    int count;
+    int cap;
+} strlist_t;
+
 typedef struct {
     char *name;
-    char *value;
+    char *value;        // joined form, built on first use
+    strlist_t *list;    // word form, built on first use
 } var_t;
 
+typedef struct hnode {
+    char *key;
+    void *value;
+    struct hnode *next;
+} hnode_t;
+
+typedef struct {
+    hnode_t **buckets;
+    size_t size;
+    size_t count;
+} hmap_t;
+
 typedef struct {
     char *name;
-    char *(*func)(int, char **);
+    int (*func)(int, char **, strlist_t *);
 } jsf_t;
 
 typedef struct {
-    int virtual;
-    int debug;
-    char *file;
-    char **rules;
-} juneopt_t;
+    char *data;
+    size_t size;
+    int mapped;
+} jfile_t;
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} view_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int refs;
+    jfile_t jf;         // mapped once for the jfile and its variants
+    hmap_t execs;       // $[exec] arguments -> strlist_t *
+    hmap_t blocks;      // @variant name -> strlist_t * of "NAME = value"
+    strlist_t names;    // @variant names, in jfile order
+} shared_t;
+
+typedef struct {
+    int exists;         // -1 when the file must be stat-ed again
+    long mtime;
+    int runs;           // g_runs when stat-ed
+} statent_t;
+
+typedef struct {
+    long mtime;         // mtime of the file when logged
+    long effective;     // mtime of the last content change
+    uint64_t hash;
+} logent_t;
+
+typedef struct {
+    char *ring;
+    size_t start;
+    size_t len;
+    FILE *spill;
+    size_t spilled;
+    int fd;             // where joblog_flush writes it
+} joblog_t;
+
+typedef struct {
+    double start;
+    double end;         // 0 until a build returns
+    int targets;
+    int built;
+    int up_to_date;
+    int failed;
+    int commands;
+    int unchanged;
+    int cutoff;
+    int scanned;
+    double scan_time;
+    int uploaded;       // inputs sent to the worker
+    int deduped;        // inputs the worker already had
+} junestats_t;
+
+enum {
+    JS_BUILT,
+    JS_UP_TO_DATE,
+    JS_NO_CMDS,
+    JS_FAILED
+};
+
+/* the state of one jfile lives in a june_t, the thread
+ * working on it makes it current and the g_ names are
+ * its fields. Paths are relative to dirfd, never to the
+ * process cwd
+*/
+
+struct june {
+    juneopt_t opt;
+    junestats_t stats;
+    joblog_t joblog;    // stdout of the jobs
+    joblog_t errlog;    // and their stderr
+    rule_t *rules;
+    var_t *vars;
+    hmap_t names;       // rule name -> rule_t *
+    hmap_t paterns;     // dst_ext -> NULL terminated rule_t * array
+    hmap_t dirs;        // scanned directory prefix -> unlisted + 1 when read
+    hmap_t files;       // path without extension -> extension list
+    hmap_t log;         // output path -> logent_t *
+    hmap_t stat;        // path -> statent_t *, filled by the scan phase
+    hmap_t done;        // target -> status + 1 of the rules already run
+    statent_t *scan_ents;
+    int log_dirty;
+    int builds;
+    int runs;           // recipes run, older stats may be stale
+    int unlisted;       // of which left a declared output missing
+    int dirfd;          // directory of the jfile
+    shared_t *shared;   // with the variants of the same jfile
+    hmap_t overrides;   // variables the jfile cannot assign
+    char *variant;
+    char *logname;
+    struct backend *backend;
+    struct {
+        FILE *in;
+        FILE *out;
+    } remote;
+};
+
+static __thread june_t *g_june;
+
+#define g_opt       (g_june->opt)
+#define g_stats     (g_june->stats)
+#define g_joblog    (g_june->joblog)
+#define g_errlog    (g_june->errlog)
+#define g_rules     (g_june->rules)
+#define g_vars      (g_june->vars)
+#define g_names     (g_june->names)
+#define g_paterns   (g_june->paterns)
+#define g_dirs      (g_june->dirs)
+#define g_files     (g_june->files)
+#define g_log       (g_june->log)
+#define g_stat      (g_june->stat)
+#define g_done      (g_june->done)
+#define g_scan_ents (g_june->scan_ents)
+#define g_log_dirty (g_june->log_dirty)
+#define g_dirfd     (g_june->dirfd)
+#define g_runs      (g_june->runs)
+#define g_unlisted  (g_june->unlisted)
+#define g_backend   (g_june->backend)
+#define g_remote    (g_june->remote)
+#define g_overrides (g_june->overrides)
+#define g_logname   (g_june->logname)
+
+/*********************************
+ *                              *
+ *         Build Events         *
+ *                              *
+*********************************/
+
+static double get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ev_str(char *key, char *value);
+
+static int ev_begin(char *type) {
+    // the worker has no june_t
+    if (!g_june || !g_opt.events)
+        return 0;
+
+    // variants may share the stream, one event at a time
+    flockfile(g_opt.events);
+    fprintf(g_opt.events, "{\"event\":\"%s\",\"time\":%.6f", type, get_time() - g_stats.start);
+
+    if (g_opt.variant)
+        ev_str("variant", g_opt.variant);
+
+    return 1;
+}
+
+static void json_str(FILE *f, char *value) {
+    putc('"', f);
+    for (; *value; value++) {
+        unsigned char c = *value;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            putc(c, f);
+    }
+    putc('"', f);
+}
+
+static void ev_str(char *key, char *value) {
+    fprintf(g_opt.events, ",\"%s\":", key);
+    json_str(g_opt.events, value);
+}
+
+static void ev_int(char *key, long value) {
+    fprintf(g_opt.events, ",\"%s\":%ld", key, value);
+}
+
+static void ev_dbl(char *key, double value) {
+    fprintf(g_opt.events, ",\"%s\":%.6f", key, value);
+}
+
+static void ev_end(void) {
+    fputs("}\n", g_opt.events);
+    funlockfile(g_opt.events);
+}
+
+static void june_error(char *fmt, ...) {
+    char msg[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    fprintf(stderr, "June: %s\n", msg);
+
+    if (ev_begin("error")) {
+        ev_str("message", msg);
+        ev_end();
+    }
+}
+
+/*********************************
+ *                              *
+ *          Hash Maps           *
+ *                              *
+*********************************/
+
+#define FNV_BASIS 0xcbf29ce484222325
+
+static uint64_t hash_data(uint64_t h, const void *data, size_t len) {
+    // FNV-1a, h is FNV_BASIS or a previous result
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3;
+    return h;
+}
+
+static uint64_t hash_str(const char *s) {
+    return hash_data(FNV_BASIS, s, strlen(s));
+}
+
+static void hmap_init(hmap_t *m, size_t size) {
+    // size must be a power of two
+    m->buckets = calloc(size, sizeof(hnode_t *));
+    m->size = size;
+    m->count = 0;
+}
+
+static void *hmap_get(hmap_t *m, const char *key) {
+    if (!m->buckets)
+        return NULL;
+
+    for (hnode_t *n = m->buckets[hash_str(key) & (m->size - 1)]; n; n = n->next) {
+        if (!strcmp(n->key, key))
+            return n->value;
+    }
+
+    return NULL;
+}
+
+static void hmap_grow(hmap_t *m) {
+    hnode_t **old = m->buckets;
+    size_t old_size = m->size;
+
+    hmap_init(m, old_size * 2);
+    m->count = 0;
+
+    for (size_t i = 0; i < old_size; i++) {
+        for (hnode_t *n = old[i], *next; n; n = next) {
+            next = n->next;
+            size_t h = hash_str(n->key) & (m->size - 1);
+            n->next = m->buckets[h];
+            m->buckets[h] = n;
+            m->count++;
+        }
+    }
+
+    free(old);
+}
+
+static void hmap_put(hmap_t *m, const char *key, void *value) {
+    // the key is copied, an existing value is replaced
+    if (!m->buckets)
+        hmap_init(m, 64);
+
+    size_t h = hash_str(key) & (m->size - 1);
+
+    for (hnode_t *n = m->buckets[h]; n; n = n->next) {
+        if (!strcmp(n->key, key)) {
+            n->value = value;
+            return;
+        }
+    }
+
+    hnode_t *n = malloc(sizeof(hnode_t));
+    n->key = strdup(key);
+    n->value = value;
+    n->next = m->buckets[h];
+    m->buckets[h] = n;
+
+    if (++m->count > m->size * 2)
+        hmap_grow(m);
+}
 
-rule_t *g_rules;
-var_t *g_vars;
-juneopt_t g_opt;
+static void hmap_free(hmap_t *m, void (*free_value)(void *)) {
+    if (!m->buckets)
+        return;
+
+    for (size_t i = 0; i < m->size; i++) {
+        for (hnode_t *n = m->buckets[i], *next; n; n = next) {
+            next = n->next;
+            if (free_value)
+                free_value(n->value);
+            free(n->key);
+            free(n);
+        }
+    }
+
+    free(m->buckets);
+    memset(m, 0, sizeof(hmap_t));
+}
 
 /*********************************
  *                              *
@@ -55,29 +401,70 @@ juneopt_t g_opt;
  *                              *
 *********************************/
 
-char *get_var(char *name) {
+static void list_free(strlist_t *list);
+static char *list_join(strlist_t *list);
+static void list_split(strlist_t *list, char *str);
+
+static var_t *find_var(char *name) {
     for (int i = 0; g_vars[i].name; i++) {
         if (!strcmp(g_vars[i].name, name))
-            return g_vars[i].value;
+            return g_vars + i;
     }
 
     return NULL;
 }
 
-int set_var(char *name, char *value) {
-    for (int i = 0; g_vars[i].name; i++) {
-        if (!strcmp(g_vars[i].name, name)) {
-            free(g_vars[i].value);
-            g_vars[i].value = value;
-            free(name);
-            return 0;
-        }
+static char *get_var(char *name) {
+    var_t *var = find_var(name);
+
+    if (!var)
+        return NULL;
+
+    if (!var->value)
+        var->value = list_join(var->list);
+
+    return var->value;
+}
+
+static strlist_t *get_var_list(char *name) {
+    var_t *var = find_var(name);
+
+    if (!var)
+        return NULL;
+
+    if (!var->list) {
+        var->list = calloc(1, sizeof(strlist_t));
+        list_split(var->list, var->value);
+    }
+
+    return var->list;
+}
+
+static void free_var(var_t *var) {
+    free(var->value);
+    if (var->list) {
+        list_free(var->list);
+        free(var->list);
+    }
+}
+
+static int set_var(char *name, char *value, strlist_t *list) {
+    // either value or list is set, the other is built when needed
+    var_t *var = find_var(name);
+
+    if (var) {
+        free_var(var);
+        var->value = value;
+        var->list = list;
+        free(name);
+        return 0;
     }
 
     for (int i = 0; i < MAX_VARS; i++) {
         if (!g_vars[i].name) {
             g_vars[i].name = name;
             g_vars[i].value = value;
+            g_vars[i].list = list;
             return 0;
         }
     }
@@ -85,17 +472,20 @@ int set_var(char *name, char *value) {
     return 1;
 }
 
-void free_globals() {
+static void free_globals() {
     for (int i = 0; g_vars[i].name; i++) {
         free(g_vars[i].name);
-        free(g_vars[i].value);
+        free_var(g_vars + i);
     }
     for (int i = 0; g_rules[i].name; i++) {
         if (g_rules[i].is_patern) {
             free(g_rules[i].patern.src_ext);
             free(g_rules[i].patern.dst_ext);
+            free(g_rules[i].patern.odir);
         } else {
-            free(g_rules[i].name);
+            for (int j = 0; g_rules[i].outs[j]; j++)
+                free(g_rules[i].outs[j]);
+            free(g_rules[i].outs);
         }
         for (int j = 0; g_rules[i].deps[j]; j++)
             free(g_rules[i].deps[j]);
@@ -106,13 +496,26 @@ void free_globals() {
             free(g_rules[i].cmds[j]);
         free(g_rules[i].cmds);
     }
+
+    hmap_free(&g_names, NULL);
+    hmap_free(&g_paterns, free);
+    hmap_free(&g_dirs, NULL);
+    hmap_free(&g_files, free);
+    hmap_free(&g_log, free);
+    hmap_free(&g_stat, NULL);
+    hmap_free(&g_done, NULL);
+    free(g_scan_ents);
 }
 
-void print_rule(rule_t *rule) {
+static void print_rule(rule_t *rule) {
     if (rule->is_patern) {
-        fprintf(stderr, "RULE: %s -> %s\n", rule->patern.src_ext, rule->patern.dst_ext);
+        fprintf(stderr, "RULE: %s -> %s%s%s\n", rule->patern.src_ext, rule->patern.odir, rule->patern.dst_ext,
+                rule->restat ? " (restat)" : "");
     } else {
-        fprintf(stderr, "RULE: %s\n", rule->name);
+        fprintf(stderr, "RULE:");
+        for (int i = 0; rule->outs[i]; i++)
+            fprintf(stderr, " %s", rule->outs[i]);
+        fprintf(stderr, "%s\n", rule->restat ? " (restat)" : "");
     }
 
     for (int i = 0; rule->deps[i]; i++)
@@ -130,134 +533,461 @@ void print_rule(rule_t *rule) {
  *                              *
 *********************************/
 
-char *read_line(FILE *f) {
-    char *line = NULL;
-    size_t cap = 0;
-    ssize_t len;
+static int map_file(int dir, char *name, jfile_t *jf) {
+    struct stat st;
+    int fd;
 
-    if ((len = getline(&line, &cap, f)) <= 0) {
-        free(line);
-        return NULL;
+    if ((fd = openat(dir, name, O_RDONLY | O_CLOEXEC)) == -1)
+        return 1;
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 1;
     }
 
-    return line;
+    jf->size = st.st_size;
+    jf->mapped = 0;
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        jf->data = mmap(NULL, jf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (jf->data != MAP_FAILED) {
+            madvise(jf->data, jf->size, MADV_SEQUENTIAL);
+            jf->mapped = 1;
+        }
+    }
+
+    if (!jf->mapped) {
+        // pipes and empty files cannot be mapped
+        size_t cap = 4096;
+        ssize_t len;
+
+        jf->data = malloc(cap);
+        jf->size = 0;
+        while ((len = read(fd, jf->data + jf->size, cap - jf->size)) > 0) {
+            jf->size += len;
+            if (jf->size == cap)
+                jf->data = realloc(jf->data, cap *= 2);
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+static void unmap_file(jfile_t *jf) {
+    if (jf->mapped)
+        munmap(jf->data, jf->size);
+    else
+        free(jf->data);
 }
 
-int file_exists(char *name) {
-    if (!g_opt.virtual && access(name, F_OK) == -1)
+static int next_line(jfile_t *jf, size_t *pos, view_t *line) {
+    // line view without the '\n', nothing is copied
+    char *end;
+
+    if (*pos >= jf->size)
         return 0;
+
+    line->ptr = jf->data + *pos;
+    end = memchr(line->ptr, '\n', jf->size - *pos);
+    line->len = end ? (size_t) (end - line->ptr) : jf->size - *pos;
+    *pos += line->len + 1;
+
     return 1;
 }
 
-FILE *chdir_and_open(char *name, char *mode) {
+static statent_t *stat_lookup(char *name) {
+    // NULL if the path was not part of the scan phase
+    statent_t *e = hmap_get(&g_stat, name);
+    struct stat buf;
+
+    // any recipe may have written any file since the stat
+    if (e && (e->exists == -1 || e->runs != g_runs)) {
+        e->exists = fstatat(g_dirfd, name, &buf, 0) != -1;
+        e->mtime = e->exists ? buf.st_mtime : -1;
+        e->runs = g_runs;
+    }
+
+    return e;
+}
+
+static void stat_forget(char *name) {
+    statent_t *e = hmap_get(&g_stat, name);
+    if (e)
+        e->exists = -1;
+}
+
+static int file_exists(char *name) {
+    statent_t *e;
+
+    if (g_opt.virtual)
+        return 1;
+    if ((e = stat_lookup(name)))
+        return e->exists;
+    return faccessat(g_dirfd, name, F_OK, 0) != -1;
+}
+
+static int open_jfile(char *name, jfile_t *jf) {
+    // its directory becomes the base of every path
     char *dir = strdup(name);
     char *tmp = strrchr(dir, '/');
-    FILE *f = fopen(name, mode);
-    if (tmp) {
-        *tmp = '\0';
-        chdir(dir);
-    }
+
+    if (tmp)
+        tmp[1] = '\0';
+
+    // no fd of june may leak into the recipes, whichever
+    // thread of the host program forks them
+    g_dirfd = open(tmp ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
     free(dir);
+
+    return g_dirfd == -1 || map_file(AT_FDCWD, name, jf);
+}
+
+static FILE *june_fopen(char *name, char *mode) {
+    // fopen relative to the jfile, mode is "r" or "w"
+    int fd = *mode == 'r' ? openat(g_dirfd, name, O_RDONLY | O_CLOEXEC) :
+            openat(g_dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    FILE *f;
+
+    if (fd == -1)
+        return NULL;
+
+    if (!(f = fdopen(fd, mode)))
+        close(fd);
+
     return f;
 }
 
-long file_last_modif(char *name) {
+static long file_last_modif(char *name) {
     struct stat buf;
-    if (stat(name, &buf) == -1)
+    statent_t *e;
+
+    if ((e = stat_lookup(name)))
+        return e->mtime;
+    if (fstatat(g_dirfd, name, &buf, 0) == -1)
         return -1;
     return buf.st_mtime;
 }
 
+static int hash_file(int dir, char *name, uint64_t *hash) {
+    char buf[65536];
+    ssize_t len;
+    int fd;
+
+    if ((fd = openat(dir, name, O_RDONLY | O_CLOEXEC)) == -1)
+        return 1;
+
+    *hash = FNV_BASIS;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        *hash = hash_data(*hash, buf, len);
+
+    close(fd);
+    return len < 0;
+}
+
+/*********************************
+ *                              *
+ *      Character Scanning      *
+ *                              *
+*********************************/
+
+// locale independent character classes
+
+#define CC_SPACE 0x01
+#define CC_ALPHA 0x02
+#define CC_ALNUM 0x04
+#define CC_VAR   0x08
+#define CC_FNAME 0x10
+
+#define is_cc(c, cls) (g_cclass[(unsigned char) (c)] & (cls))
+
+static const unsigned char g_cclass[256] = {
+    ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE,
+    ['\f'] = CC_SPACE, ['\r'] = CC_SPACE, [' ']  = CC_SPACE,
+
+    ['0' ... '9'] = CC_ALNUM | CC_VAR | CC_FNAME,
+    ['A' ... 'Z'] = CC_ALPHA | CC_ALNUM | CC_VAR | CC_FNAME,
+    ['a' ... 'z'] = CC_ALPHA | CC_ALNUM | CC_VAR | CC_FNAME,
+
+    ['_'] = CC_VAR | CC_FNAME,
+    ['.'] = CC_FNAME,
+    ['-'] = CC_FNAME,
+    ['/'] = CC_FNAME,
+};
+
+// scan kinds, SK_CHAR matches a single given character
+
+enum {
+    SK_CHAR,
+    SK_SPACE,
+    SK_FNAME
+};
+
+static int sk_match(char c, int kind, char ref) {
+    switch (kind) {
+        case SK_CHAR:
+            return c == ref;
+        case SK_SPACE:
+            return !!is_cc(c, CC_SPACE);
+        default:
+            return !!is_cc(c, CC_FNAME);
+    }
+}
+
+static size_t scalar_scan(const char *s, size_t len, int kind, char c, int skip) {
+    // index of the first char matching (or not matching if skip) kind
+    size_t i = 0;
+    while (i < len && sk_match(s[i], kind, c) == skip)
+        i++;
+    return i;
+}
+
+static void scalar_blank(char *s, size_t len) {
+    // replace white spaces with ' '
+    for (size_t i = 0; i < len; i++) {
+        if (is_cc(s[i], CC_SPACE))
+            s[i] = ' ';
+    }
+}
+
+#ifdef JUNE_X86
+
+/* bytes >= 0x80 are negative for the signed compares
+ * below, so they never fall in any of the ranges
+*/
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_range(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_match(__m128i v, int kind, char c) {
+    switch (kind) {
+        case SK_CHAR:
+            return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+        case SK_SPACE:
+            return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                sse2_range(v, '\t', '\r'));
+        default:
+            // '-' '.' '/' and digits are contiguous, 0x20 folds the case
+            return _mm_or_si128(
+                _mm_or_si128(sse2_range(v, '-', '9'),
+                             sse2_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    }
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline size_t sse2_scan_kind(const char *s, size_t len, int kind, char c, int skip) {
+    unsigned flip = skip ? 0xffff : 0;
+    unsigned m;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        if ((m = _mm_movemask_epi8(sse2_match(v, kind, c)) ^ flip))
+            return i + __builtin_ctz(m);
+    }
+
+    // never load past len, the tail is at most 15 bytes
+    return i + scalar_scan(s + i, len - i, kind, c, skip);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_scan(const char *s, size_t len, int kind, char c, int skip) {
+    // dispatch once so that each loop gets a constant kind
+    switch (kind) {
+        case SK_CHAR:
+            return sse2_scan_kind(s, len, SK_CHAR, c, skip);
+        case SK_SPACE:
+            return sse2_scan_kind(s, len, SK_SPACE, c, skip);
+        default:
+            return sse2_scan_kind(s, len, SK_FNAME, c, skip);
+    }
+}
+
+__attribute__((target("sse2")))
+static void sse2_blank(char *s, size_t len) {
+    __m128i sp = _mm_set1_epi8(' ');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i m = sse2_match(v, SK_SPACE, 0);
+        if (_mm_movemask_epi8(m))
+            _mm_storeu_si128((__m128i *) (s + i),
+                    _mm_or_si128(_mm_andnot_si128(m, v), _mm_and_si128(m, sp)));
+    }
+
+    scalar_blank(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_range(__m256i v, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_match(__m256i v, int kind, char c) {
+    switch (kind) {
+        case SK_CHAR:
+            return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+        case SK_SPACE:
+            return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                   avx2_range(v, '\t', '\r'));
+        default:
+            return _mm256_or_si256(
+                _mm256_or_si256(avx2_range(v, '-', '9'),
+                                avx2_range(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    }
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline size_t avx2_scan_kind(const char *s, size_t len, int kind, char c, int skip) {
+    unsigned flip = skip ? 0xffffffff : 0;
+    unsigned m;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        if ((m = (unsigned) _mm256_movemask_epi8(avx2_match(v, kind, c)) ^ flip))
+            return i + __builtin_ctz(m);
+    }
+
+    // at most 31 bytes left, one sse2 vector then scalar
+    return i + sse2_scan_kind(s + i, len - i, kind, c, skip);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_scan(const char *s, size_t len, int kind, char c, int skip) {
+    switch (kind) {
+        case SK_CHAR:
+            return avx2_scan_kind(s, len, SK_CHAR, c, skip);
+        case SK_SPACE:
+            return avx2_scan_kind(s, len, SK_SPACE, c, skip);
+        default:
+            return avx2_scan_kind(s, len, SK_FNAME, c, skip);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_blank(char *s, size_t len) {
+    __m256i sp = _mm256_set1_epi8(' ');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i m = avx2_match(v, SK_SPACE, 0);
+        if (_mm256_movemask_epi8(m))
+            _mm256_storeu_si256((__m256i *) (s + i), _mm256_blendv_epi8(v, sp, m));
+    }
+
+    sse2_blank(s + i, len - i);
+}
+
+#endif
+
+static size_t (*g_scan)(const char *, size_t, int, char, int) = scalar_scan;
+static void (*g_blank)(char *, size_t) = scalar_blank;
+
+static void scan_init(void) {
+    #ifdef JUNE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan = avx2_scan;
+        g_blank = avx2_blank;
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_scan = sse2_scan;
+        g_blank = sse2_blank;
+    }
+    #endif
+}
+
 /*********************************
  *                              *
  *   String Utility Functions   *
  *                              *
 *********************************/
 
-int is_valid_varname(char *name) {
+static int is_valid_varname(char *name) {
     if (*name == '\0')
         return 0;
 
-    if (!isalpha(*name) && *name != '_')
+    if (!is_cc(*name, CC_ALPHA) && *name != '_')
         return 0;
 
     for (int i = 1; name[i]; i++) {
-        if (!isalnum(name[i]) && name[i] != '_')
+        if (!is_cc(name[i], CC_VAR))
             return 0;
     }
 
     return 1;
 }
 
-int is_valid_filename(char *name) {
-    if (*name == '\0')
-        return 0;
+static int is_valid_filename(char *name) {
+    size_t len = strlen(name);
 
-    for (int i = 0; name[i]; i++) {
-        if (!isalnum(name[i]) &&
-            name[i] != '.' &&
-            name[i] != '_' &&
-            name[i] != '-' &&
-            name[i] != '/'
-        ) return 0;
-    }
+    return len && g_scan(name, len, SK_FNAME, 0, 1) == len;
+}
 
-    return 1;
+static char *get_ext(char *name) {
+    // the dot of the last path component, "./main" has none
+    char *ext = strrchr(name, '.');
+    char *slash = strrchr(name, '/');
+
+    if (!ext || (slash && slash > ext))
+        return NULL;
+
+    return ext;
 }
 
-char *rm_ext(char *name) {
+static char *rm_ext(char *name) {
     char *tmp = strdup(name);
-    char *ext = strrchr(tmp, '.');
+    char *ext = get_ext(tmp);
     if (ext)
         *ext = '\0';
     return tmp;
 }
 
-int is_right_ext(char *name, char *ext) {
-    // ext does not contain the dot
-    char *tmp = strrchr(name, '.');
-
-    if (!tmp)
-        return 0;
-
-    return !strcmp(tmp + 1, ext);
-}
-
 
 
-char *str_trim(char *str) {
+static char *str_trim(char *str) {
     int len = strlen(str);
-    while (len > 0 && isspace(str[len - 1]))
+    while (len > 0 && is_cc(str[len - 1], CC_SPACE))
         str[--len] = '\0';
     return str;
 }
 
-char *str_triml(char *str) {
-    while (isspace(*str))
+static char *str_triml(char *str) {
+    while (is_cc(*str, CC_SPACE))
         str++;
     return str;
 }
 
-char **str_split(char *s, char c) {
+static char **str_split(char *s, char c) {
     // if consecutive c, only one split
     // allocate each string
 
 	char	**res;
-	int		start;
+	size_t	len;
+	size_t	start;
 	int		i_tab;
-	int		i;
+	size_t	i;
 
 	i = 0;
 	start = 0;
 	i_tab = 0;
-	res = malloc(sizeof(char *) * (strlen(s) + 1));
-	while (s[i])
+	len = strlen(s);
+	res = malloc(sizeof(char *) * (len + 1));
+	while (i < len)
 	{
-		while (s[i] && c == s[i])
-			i++;
+		i += g_scan(s + i, len - i, SK_CHAR, c, 1);
 		start = i;
-		while (s[i] && c != s[i])
-			i++;
+		i += g_scan(s + i, len - i, SK_CHAR, c, 0);
 		if (start < i)
 			res[i_tab++] = strndup(s + start, i - start);
 	}
@@ -265,39 +995,97 @@ char **str_split(char *s, char c) {
 	return (res);
 }
 
+static void list_push(strlist_t *list, char *item) {
+    if (list->count + 1 >= list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, sizeof(char *) * list->cap);
+    }
+    list->items[list->count++] = item;
+    list->items[list->count] = NULL;
+}
+
+static void list_free(strlist_t *list) {
+    for (int i = 0; i < list->count; i++)
+        free(list->items[i]);
+    free(list->items);
+    memset(list, 0, sizeof(strlist_t));
+}
+
+static char **list_release(strlist_t *list) {
+    // gives the NULL terminated items to the caller
+    char **items = list->items;
+
+    if (!items)
+        items = calloc(1, sizeof(char *));
+
+    memset(list, 0, sizeof(strlist_t));
+    return items;
+}
+
+static char *list_join(strlist_t *list) {
+    size_t len = 1;
+    char *ret, *tmp;
+
+    for (int i = 0; i < list->count; i++)
+        len += strlen(list->items[i]) + 1;
+
+    tmp = ret = malloc(len);
+    *ret = '\0';
+
+    for (int i = 0; i < list->count; i++) {
+        if (i)
+            *tmp++ = ' ';
+        tmp = stpcpy(tmp, list->items[i]);
+    }
+
+    return ret;
+}
+
+static void list_split(strlist_t *list, char *str) {
+    // pushes a copy of each word of str
+    size_t len = strlen(str);
+    size_t start, i = 0;
+
+    while (i < len) {
+        i += g_scan(str + i, len - i, SK_SPACE, 0, 1);
+        start = i;
+        i += g_scan(str + i, len - i, SK_SPACE, 0, 0);
+        if (start < i)
+            list_push(list, strndup(str + start, i - start));
+    }
+}
+
 /*********************************
  *                              *
  *      June SubFunctions       *
  *                              *
 *********************************/
 
-char *jsf_exec(int lnb, char **argv) {
-    if (!argv[1]) {
-        fprintf(stderr, "June: line %d: exec: Missing command\n", lnb);
-        return NULL;
-    }
-
-    int fds[2];
+static int exec_argv(int lnb, char **argv, strlist_t *out) {
+    int fds[2], dir = g_dirfd;
 
-    if (pipe(fds) == -1) {
-        fprintf(stderr, "June: line %d: exec: Pipe failed\n", lnb);
-        return NULL;
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        june_error("line %d: exec: Pipe failed", lnb);
+        return 1;
     }
 
     int pid = fork();
 
     if (pid == -1) {
-        fprintf(stderr, "June: line %d: exec: Fork failed\n", lnb);
-        return NULL;
+        june_error("line %d: exec: Fork failed", lnb);
+        return 1;
     }
 
     if (pid == 0) {
         close(fds[0]);
         dup2(fds[1], 1);
         close(fds[1]);
+        if (fchdir(dir))
+            _exit(1);
         execvp(argv[1], argv + 1);
+        // no june_error here, the events buffer belongs to the parent
         fprintf(stderr, "June: line %d: exec: Command not found\n", lnb);
-        exit(1);
+        _exit(1);
     }
 
     close(fds[1]);
@@ -319,49 +1107,86 @@ char *jsf_exec(int lnb, char **argv) {
     waitpid(pid, &status, 0);
 
     if (WIFEXITED(status) && WEXITSTATUS(status)) {
-        fprintf(stderr, "June: line %d: exec: Command failed\n", lnb);
+        june_error("line %d: exec: Command failed", lnb);
         free(data);
-        return NULL;
+        return 1;
+    }
+
+    if (data)
+        list_split(out, data);
+
+    free(data);
+    return 0;
+}
+
+static int jsf_exec(int lnb, char **argv, strlist_t *out) {
+    // variants reuse the results of the same arguments
+    shared_t *sh = g_june->shared;
+    int before = out->count, ret = 0;
+    strlist_t *memo;
+    size_t len = 0;
+    char *key;
+
+    if (!argv[1]) {
+        june_error("line %d: exec: Missing command", lnb);
+        return 1;
     }
 
-    for (int i = 0; data[i]; i++) {
-        if (isspace(data[i]))
-            data[i] = ' ';
+    for (int i = 1; argv[i]; i++)
+        len += strlen(argv[i]) + 1;
+
+    key = malloc(len + 1);
+    *key = '\0';
+    for (int i = 1; argv[i]; i++)
+        strcat(strcat(key, argv[i]), "\n");
+
+    pthread_mutex_lock(&sh->lock);
+
+    if (g_opt.variant && (memo = hmap_get(&sh->execs, key))) {
+        for (int i = 0; i < memo->count; i++)
+            list_push(out, strdup(memo->items[i]));
+    } else if (!(ret = exec_argv(lnb, argv, out)) && !hmap_get(&sh->execs, key)) {
+        memo = calloc(1, sizeof(strlist_t));
+        for (int i = before; i < out->count; i++)
+            list_push(memo, strdup(out->items[i]));
+        hmap_put(&sh->execs, key, memo);
     }
 
-    return data;
+    pthread_mutex_unlock(&sh->lock);
+    free(key);
+
+    return ret;
 }
 
-char *jsf_nick(int lnb, char **argv) {
+static int jsf_nick(int lnb, char **argv, strlist_t *out) {
     if (!argv[1] || !argv[2]) {
-        fprintf(stderr, "June: line %d: nick: Missing arguments\n", lnb);
-        return NULL;
+        june_error("line %d: nick: Missing arguments", lnb);
+        return 1;
     }
 
     char *ext = argv[1];
-    char *ret = NULL;
-    int len = 0;
+    size_t elen = strlen(ext);
 
     for (int i = 2; argv[i]; i++) {
-        char *tmp = rm_ext(argv[i]);
-        ret = realloc(ret, len + strlen(tmp) + strlen(ext) + 3);
-        if (len)
-            len += sprintf(ret + len, " %s.%s", tmp, ext);
-        else
-            len = sprintf(ret, "%s.%s", tmp, ext);
-        free(tmp);
+        char *dot = get_ext(argv[i]);
+        size_t len = dot ? (size_t) (dot - argv[i]) : strlen(argv[i]);
+        char *tmp = malloc(len + elen + 2);
+        memcpy(tmp, argv[i], len);
+        tmp[len] = '.';
+        memcpy(tmp + len + 1, ext, elen + 1);
+        list_push(out, tmp);
     }
 
-    return ret;
+    return 0;
 }
 
-jsf_t g_jsf[] = {
+static jsf_t g_jsf[] = {
     {"exec", jsf_exec},
     {"nick", jsf_nick},
     {NULL, NULL}
 };
 
-void *get_jsf(char *name) {
+static void *get_jsf(char *name) {
     for (int i = 0; g_jsf[i].name; i++) {
         if (!strcmp(g_jsf[i].name, name))
             return g_jsf[i].func;
@@ -375,44 +1200,70 @@ void *get_jsf(char *name) {
  *                              *
 *********************************/
 
-int tream_line(char *sline, char **line) {
+static int tream_line(view_t *line) {
+    // only moves the view bounds, the mapping is read only
+    const char *tmp;
     int indent;
-    char *tmp;
 
-    *line = sline;
+    indent = line->len && is_cc(*line->ptr, CC_SPACE);
+    while (line->len && is_cc(*line->ptr, CC_SPACE)) {
+        line->ptr++;
+        line->len--;
+    }
+
+    if ((tmp = memchr(line->ptr, '/', line->len)) &&
+            tmp + 1 < line->ptr + line->len && tmp[1] == '/')
+        line->len = tmp - line->ptr;
 
-    *line = str_triml(*line);
-    indent = *line != sline;
+    if ((tmp = memchr(line->ptr, '#', line->len)))
+        line->len = tmp - line->ptr;
 
-    if ((tmp = strchr(*line, '/')) && tmp[1] == '/')
-        *tmp = '\0';
+    while (line->len && is_cc(line->ptr[line->len - 1], CC_SPACE))
+        line->len--;
 
-    if ((tmp = strchr(*line, '#')))
-        *tmp = '\0';
+    return indent;
+}
 
-    str_trim(*line);
+static size_t bracket_end(const char *src, size_t len) {
+    // src starts with '[', length up to the matching ']' included
+    int count = 1;
+    size_t i = 1;
 
-    // replace white spaces with ' '
-    for (int i = 0; (*line)[i]; i++) {
-        if (isspace((*line)[i]))
-            (*line)[i] = ' ';
+    while (i < len && count) {
+        if (src[i] == '[')
+            count++;
+        else if (src[i] == ']')
+            count--;
+        i++;
     }
 
-    return indent;
+    return count ? 0 : i;
 }
 
-char *expand_vars(char *src, int lnb) {
-    char *line = strdup(src);
+static int is_list_word(const char *word, size_t len) {
+    // single $[...] subfunction call
+    return len > 2 && word[0] == '$' && word[1] == '[' &&
+            bracket_end(word + 1, len - 1) == len - 1;
+}
+
+static int call_subfunc(const char *src, size_t len, int lnb, strlist_t *out, strlist_t *keep);
+
+static char *expand_vars(const char *src, size_t slen, int lnb) {
+    char *line = strndup(src, slen);
+    size_t llen = strlen(line);
     char *value;
 
+    g_blank(line, llen);
+
     for (int i = 0; line[i]; i++) {
+        i += g_scan(line + i, llen - i, SK_CHAR, '$', 0);
         if (line[i] != '$')
-            continue;
+            break;
 
         int start = ++i;
 
         if (line[i] == '\0') {
-            fprintf(stderr, "June: line %d: Invalid variable name\n", lnb);
+            june_error("line %d: Invalid variable name", lnb);
             free(line);
             return NULL;
         }
@@ -423,70 +1274,28 @@ char *expand_vars(char *src, int lnb) {
             strcpy(tmp + i - 1, line + i + 1);
             free(line);
             line = tmp;
+            llen = strlen(line);
             continue;
         }
 
         if (line[i] == '[') {
-            char *tmp, *subfunc, **args;
-
-            // find the closing bracket
-            int count = 1;
-            int j = i + 1;
-            while (line[j] && count) {
-                if (line[j] == '[')
-                    count++;
-                else if (line[j] == ']')
-                    count--;
-                j++;
-            }
-
-            if (count) {
-                fprintf(stderr, "June: line %d: Invalid subfunction\n", lnb);
-                free(line);
-                return NULL;
-            }
-
-            tmp = strndup(line + i + 1, j - i - 2); // cause malloc is cool
-            subfunc = expand_vars(str_triml(str_trim(tmp)), lnb);
-            free(tmp);
-            if (!subfunc) {
-                free(line);
-                return NULL;
-            }
-
-            args = str_split(subfunc, ' ');
-            free(subfunc);
-
-            if (!args) {
-                fprintf(stderr, "June: line %d: Invalid subfunction\n", lnb);
-                free(line);
-                return NULL;
-            }
-
-            char *(*func)(int, char **) = get_jsf(args[0]);
+            strlist_t res = {0};
+            int j = i + bracket_end(line + i, llen - i);
 
-            if (!func) {
-                fprintf(stderr, "June: line %d: '%s': Subfunction not found\n", lnb, args[0]);
-                for (int j = 0; args[j]; j++)
-                    free(args[j]);
-                free(args);
+            if (j == i) {
+                june_error("line %d: Invalid subfunction", lnb);
                 free(line);
                 return NULL;
             }
 
-            value = func(lnb, args);
-
-            if (!value) {
-                for (int j = 0; args[j]; j++)
-                    free(args[j]);
-                free(args);
+            if (call_subfunc(line + i + 1, j - i - 2, lnb, &res, NULL)) {
+                list_free(&res);
                 free(line);
                 return NULL;
             }
 
-            for (int j = 0; args[j]; j++)
-                free(args[j]);
-            free(args);
+            value = list_join(&res);
+            list_free(&res);
 
             int len = strlen(value);
             char *tmp2 = malloc(strlen(line) + len);
@@ -499,14 +1308,15 @@ char *expand_vars(char *src, int lnb) {
 
             i = start + len - 2;
             line = tmp2;
+            llen = strlen(line);
             continue;
         }
 
-        while (line[i] && isalnum(line[i]))
+        while (is_cc(line[i], CC_ALNUM))
             i++;
 
         if (i == start) {
-            fprintf(stderr, "June: line %d: Invalid variable name\n", lnb);
+            june_error("line %d: Invalid variable name", lnb);
             free(line);
             return NULL;
         }
@@ -514,7 +1324,9 @@ char *expand_vars(char *src, int lnb) {
         char *name = strndup(line + start, i - start);
 
         if (strcmp(name, "0") == 0) {
+            // left for expend_var0, resume right after it
             free(name);
+            i--;
             continue;
         } else if ((value = get_var(name))) {
             int len = strlen(value);
@@ -526,8 +1338,9 @@ char *expand_vars(char *src, int lnb) {
             free(name);
             i = start + len - 2;
             line = tmp;
+            llen = strlen(line);
         } else {
-            fprintf(stderr, "June: line %d: %s: Undefined variable\n", lnb, name);
+            june_error("line %d: %s: Undefined variable", lnb, name);
             free(name);
             free(line);
             return NULL;
@@ -537,7 +1350,108 @@ char *expand_vars(char *src, int lnb) {
     return line;
 }
 
-int compute_patern(char *name, int lnb, char **src_ext, char **dst_ext) {
+static int expand_word(const char *word, size_t len, int lnb, strlist_t *out, strlist_t *keep) {
+    /* $[...] and $VAR words are spliced into out as lists,
+     * without being joined and split again. Items owned by
+     * the caller are also pushed in keep, or copied if NULL
+    */
+    int before = out->count;
+    size_t i = 1;
+    char *str;
+
+    if (is_list_word(word, len))
+        return call_subfunc(word + 2, len - 3, lnb, out, keep);
+
+    while (i < len && is_cc(word[i], CC_ALNUM))
+        i++;
+
+    if (len > 1 && word[0] == '$' && i == len && !(len == 2 && word[1] == '0')) {
+        char *name = strndup(word + 1, len - 1);
+        strlist_t *list = get_var_list(name);
+
+        if (!list) {
+            june_error("line %d: %s: Undefined variable", lnb, name);
+            free(name);
+            return 1;
+        }
+
+        for (int j = 0; j < list->count; j++)
+            list_push(out, keep ? list->items[j] : strdup(list->items[j]));
+
+        free(name);
+        return 0;
+    }
+
+    if (!(str = expand_vars(word, len, lnb)))
+        return 1;
+
+    list_split(out, str);
+    free(str);
+
+    for (int j = before; keep && j < out->count; j++)
+        list_push(keep, out->items[j]);
+
+    return 0;
+}
+
+static int expand_list(const char *src, size_t len, int lnb, strlist_t *out, strlist_t *keep) {
+    // split src in words, spaces inside $[...] do not count
+    size_t start, i = 0;
+
+    while (i < len) {
+        while (i < len && is_cc(src[i], CC_SPACE))
+            i++;
+
+        start = i;
+
+        while (i < len && !is_cc(src[i], CC_SPACE)) {
+            size_t end;
+            if (src[i] == '$' && i + 1 < len && src[i + 1] == '[' &&
+                    (end = bracket_end(src + i + 1, len - i - 1)))
+                i += end + 1;
+            else
+                i++;
+        }
+
+        if (start < i && expand_word(src + start, i - start, lnb, out, keep))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int call_subfunc(const char *src, size_t len, int lnb, strlist_t *out, strlist_t *keep) {
+    // arguments borrow the items of list variables
+    strlist_t args = {0}, owned = {0};
+    int (*func)(int, char **, strlist_t *);
+    int before = out->count;
+    int ret = 1;
+
+    if (expand_list(src, len, lnb, &args, &owned))
+        goto end;
+
+    if (!args.count) {
+        june_error("line %d: Invalid subfunction", lnb);
+        goto end;
+    }
+
+    if (!(func = get_jsf(args.items[0]))) {
+        june_error("line %d: '%s': Subfunction not found", lnb, args.items[0]);
+        goto end;
+    }
+
+    ret = func(lnb, args.items, out);
+
+    for (int i = before; keep && i < out->count; i++)
+        list_push(keep, out->items[i]);
+
+    end:
+    free(args.items);
+    list_free(&owned);
+    return ret;
+}
+
+static int compute_patern(char *name, int lnb, char **src_ext, char **dst_ext, char **odir) {
     // name: src_ext -> dst_ext || dst_ext <- src_ext
     char *tmp;
 
@@ -550,325 +1464,2996 @@ int compute_patern(char *name, int lnb, char **src_ext, char **dst_ext) {
         *dst_ext = strdup(str_trim(name));
         *src_ext = strdup(str_triml(tmp + 2));
     } else {
-        fprintf(stderr, "June: line %d: '%s': Invalid patern\n", lnb, name);
+        june_error("line %d: '%s': Invalid patern", lnb, name);
         return 1;
     }
 
-    if (!is_valid_filename(*src_ext)) {
-        fprintf(stderr, "June: line %d: '%s': Invalid source extension\n", lnb, *src_ext);
+    // [c -> build/o]: src/a.c gives build/src/a.o
+    if ((tmp = strrchr(*dst_ext, '/'))) {
+        *odir = strndup(*dst_ext, tmp - *dst_ext + 1);
+        memmove(*dst_ext, tmp + 1, strlen(tmp + 1) + 1);
+    } else {
+        *odir = strdup("");
+    }
+
+    if (!is_valid_filename(*src_ext) || strchr(*src_ext, '/')) {
+        june_error("line %d: '%s': Invalid source extension", lnb, *src_ext);
         free(*src_ext);
         free(*dst_ext);
+        free(*odir);
         return 1;
     }
 
-    if (!is_valid_filename(*dst_ext)) {
-        fprintf(stderr, "June: line %d: '%s': Invalid destination extension\n", lnb, *dst_ext);
+    if (!is_valid_filename(*dst_ext) || (**odir && !is_valid_filename(*odir))) {
+        june_error("line %d: '%s%s': Invalid destination extension", lnb, *odir, *dst_ext);
         free(*src_ext);
         free(*dst_ext);
+        free(*odir);
         return 1;
     }
 
     return 0;
 }
 
-int interp_file(FILE *f) {
-    char *line, *sline = NULL;
-    rule_t *rule = NULL;
-    int indent;
-    int lnb = 0;
-
-    while ((free(sline), lnb++, sline = read_line(f))) {
-        indent = tream_line(sline, &line);
-
-        if (*line == '\0')
-            continue;
+static size_t find_statement(view_t *line) {
+    // first '=' or else first ':' outside of subfunctions
+    size_t colon = line->len;
+    size_t end;
+
+    for (size_t i = 0; i < line->len; i++) {
+        if (line->ptr[i] == '$' && i + 1 < line->len && line->ptr[i + 1] == '[' &&
+                (end = bracket_end(line->ptr + i + 1, line->len - i - 1)))
+            i += end;
+        else if (line->ptr[i] == '=')
+            return i;
+        else if (line->ptr[i] == ':' && colon == line->len)
+            colon = i;
+    }
 
-        line = expand_vars(line, lnb);
+    return colon;
+}
 
-        if (!line) {
-            free(sline);
-            return 1;
-        }
+static int interp_var(view_t *line, size_t sep, int lnb) {
+    view_t value = {line->ptr + sep + 1, line->len - sep - 1};
+    strlist_t *list = NULL;
+    char *name, *str = NULL;
 
-        if (indent == 0) {
-            char *tmp;
-            if ((tmp = strchr(line, '='))) {
-                *tmp = '\0';
-                char *name = strdup(str_trim(line));
-                if (!is_valid_varname(name)) {
-                    fprintf(stderr, "June: line %d: '%s': Invalid variable name\n", lnb, name);
-                    free(sline);
-                    free(line);
-                    free(name);
-                    return 1;
-                }
-                set_var(name, strdup(str_triml(tmp + 1)));
-                rule = NULL;
-            } else if ((tmp = strchr(line, ':'))) {
-                *tmp = '\0';
-                char *src_ext, *dst_ext, *name = str_trim(line);
-                int is_patern = name[0] == '[' && name[strlen(name) - 1] == ']';
-
-                if (is_patern) {
-                    tmp--;
-                    *tmp = '\0';
-                    if (compute_patern(str_triml(str_trim(++name)), lnb, &src_ext, &dst_ext)) {
-                        free(sline);
-                        free(line);
-                        return 1;
-                    }
-                } else {
-                    if (!is_valid_filename(name)) {
-                        fprintf(stderr, "June: line %d: '%s': Invalid rule name\n", lnb, name);
-                        free(sline);
-                        free(line);
-                        return 1;
-                    }
-                    name = strdup(name);
-                }
+    if (!(name = expand_vars(line->ptr, sep, lnb)))
+        return 1;
 
-                char **deps = str_split(tmp + 1, ' ');
-                for (int i = 0; deps[i]; i++) {
-                    if (!is_valid_filename(deps[i])) {
-                        fprintf(stderr, "June: line %d: '%s': Invalid dependency name\n", lnb, deps[i]);
-                        if (is_patern) {
-                            free(src_ext);
-                            free(dst_ext);
-                        } else {
-                            free(name);
-                        }
-                        for (int j = 0; deps[j]; j++)
-                            free(deps[j]);
-                        free(sline);
-                        free(line);
-                        free(deps);
-                        return 1;
-                    }
-                }
+    str_trim(name);
+    memmove(name, str_triml(name), strlen(str_triml(name)) + 1);
 
-                rule = g_rules;
-                while (rule->name)
-                    rule++;
-                rule->is_patern = is_patern;
-                if (is_patern) {
-                    rule->patern.src_ext = src_ext;
-                    rule->patern.dst_ext = dst_ext;
-                } else {
-                    rule->name = name;
-                }
-                rule->deps = deps;
-                rule->cmds = NULL;
-            } else {
-                fprintf(stderr, "June: line %d: Invalid statement\n", lnb);
-                free(sline);
-                free(line);
-                return 1;
-            }
-            free(line);
-        } else {
-            if (!rule) {
-                fprintf(stderr, "June: line %d: Command without rule\n", lnb);
-                free(sline);
-                free(line);
-                return 1;
-            }
+    if (!is_valid_varname(name)) {
+        june_error("line %d: '%s': Invalid variable name", lnb, name);
+        free(name);
+        return 1;
+    }
 
-            int count = 0;
+    // variant overrides win over the jfile
+    if (hmap_get(&g_overrides, name)) {
+        free(name);
+        return 0;
+    }
 
-            if (!rule->cmds) {
-                rule->cmds = malloc(sizeof(char *) * 2);
-            } else {
-                for (count = 0; rule->cmds[count]; count++);
-                rule->cmds = realloc(rule->cmds, sizeof(char *) * (count + 2));
-            }
+    tream_line(&value);
 
-            rule->cmds[count] = line;
-            rule->cmds[count + 1] = NULL;
+    // a subfunction result is kept as a list
+    if (is_list_word(value.ptr, value.len)) {
+        list = calloc(1, sizeof(strlist_t));
+        if (expand_list(value.ptr, value.len, lnb, list, NULL)) {
+            list_free(list);
+            free(list);
+            free(name);
+            return 1;
         }
+    } else if (!(str = expand_vars(value.ptr, value.len, lnb))) {
+        free(name);
+        return 1;
     }
 
+    set_var(name, str, list);
     return 0;
 }
 
-/*********************************
- *                              *
- *        Rule Execution        *
- *                              *
-*********************************/
+static int split_override(char *line, char **name, char **value) {
+    // "NAME = value", both parts are allocated
+    char *eq = strchr(line, '=');
 
-char *expend_var0(char *line, char *val) {
-    char *tmp, *start = strstr(line, "$0");
+    if (!eq)
+        return 1;
 
-    if (!start) {
-        return line;
-    }
+    *name = strndup(line, eq - line);
+    str_trim(*name);
+    memmove(*name, str_triml(*name), strlen(str_triml(*name)) + 1);
 
-    tmp = malloc(strlen(line) + strlen(val));
-    strncpy(tmp, line, start - line);
-    strcpy(tmp + (start - line), val);
-    strcpy(tmp + (start - line) + strlen(val), start + 2);
+    if (!is_valid_varname(*name)) {
+        free(*name);
+        return 1;
+    }
 
-    free(line);
-    return expend_var0(tmp, val);
+    *value = str_trim(strdup(str_triml(eq + 1)));
+    return 0;
 }
 
-int is_up_to_date(char *name, rule_t *rule) {
-    if (g_opt.virtual) {
-        return 0;
-    }
+static int interp_variant(view_t *line, size_t sep, int lnb, strlist_t **block) {
+    // @variant name: then indented "NAME = value" lines
+    shared_t *sh = g_june->shared;
+    char *name = strndup(line->ptr + 9, sep - 9);
 
-    if (!rule->is_patern && !file_exists(name)) {
-        return 0;
-    }
+    str_trim(name);
+    memmove(name, str_triml(name), strlen(str_triml(name)) + 1);
+    *block = NULL;
 
-    for (int i = 0; rule->deps[i]; i++) {
-        if (!file_exists(rule->deps[i])) {
-            return 0;
-        }
-        if (file_last_modif(name) < file_last_modif(rule->deps[i])) {
-            return 0;
-        }
+    if (!is_valid_varname(name)) {
+        june_error("line %d: '%s': Invalid variant name", lnb, name);
+        free(name);
+        return 1;
     }
 
-    if (!rule->is_patern) {
-        printf("June: %s: Up to date\n", name);
+    if (sep + 1 < line->len) {
+        june_error("line %d: %s: Unexpected text after variant name", lnb, name);
+        free(name);
         return 1;
     }
 
-    char *noext = rm_ext(name);
-    char *in = malloc(strlen(noext) + strlen(rule->patern.src_ext) + 2);
-    char *out = malloc(strlen(noext) + strlen(rule->patern.dst_ext) + 2);
-
-    sprintf(in, "%s.%s", noext, rule->patern.src_ext);
-    sprintf(out, "%s.%s", noext, rule->patern.dst_ext);
-
-    if (!file_exists(in) || !file_exists(out) || file_last_modif(in) > file_last_modif(out)) {
-        free(noext);
-        free(in);
-        free(out);
+    // variants read the blocks recorded by their base
+    if (g_opt.variant) {
+        free(name);
         return 0;
     }
 
-    printf("June: %s: Up to date\n", out);
-    free(noext);
-    free(in);
-    free(out);
+    if (hmap_get(&sh->blocks, name)) {
+        june_error("line %d: %s: Variant already defined", lnb, name);
+        free(name);
+        return 1;
+    }
 
-    return 1;
+    *block = calloc(1, sizeof(strlist_t));
+    hmap_put(&sh->blocks, name, *block);
+    list_push(&sh->names, name);
+
+    return 0;
 }
 
-int exec_rule_rec(rule_t *rule, int depth, char *fname) {
-    /*
-    for (int j = 0; j < depth; j++)
-        putchar(' ');
-    if (rule->is_patern)
-        printf("[%s.%s -> %s.%s]\n", fname, rule->patern.src_ext, fname, rule->patern.dst_ext);
-    else
-        printf("[%s]\n", rule->name);
-    */
+static rule_t *interp_rule(view_t *line, size_t sep, int lnb) {
+    char *src_ext, *dst_ext, *odir, *name, *head;
+    strlist_t deps = {0};
+    char **outs = NULL;
+    int restat = 0;
+    rule_t *rule;
 
-    if (depth > 100) {
-        fprintf(stderr, "June: %s: Recursion limit reached\n", rule->name);
-        return 1;
-    }
+    if (!(head = expand_vars(line->ptr, sep, lnb)))
+        return NULL;
 
-    for (int i = 0; rule->deps[i]; i++) {
-        rule_t *dep = NULL;
-        for (int j = 0; g_rules[j].name; j++) {
-            if (!g_rules[j].is_patern && !strcmp(g_rules[j].name, rule->deps[i])) {
-                dep = g_rules + j;
-                break;
-            }
-        }
+    name = str_triml(str_trim(head));
 
-        if (dep) {
-            if (exec_rule_rec(dep, depth + 1, dep->name))
-                return 1;
-            continue;
+    // rule attributes: @restat name: deps
+    while (*name == '@') {
+        char *attr = name + 1;
+        name = attr + g_scan(attr, strlen(attr), SK_CHAR, ' ', 0);
+        if (name - attr == 6 && !strncmp(attr, "restat", 6)) {
+            restat = 1;
+        } else {
+            june_error("line %d: '%.*s': Invalid rule attribute", lnb, (int) (name - attr), attr);
+            free(head);
+            return NULL;
         }
+        name = str_triml(name);
+    }
 
-        char *noext = rm_ext(rule->deps[i]);
-
-        // search for patern
-        for (int j = 0; g_rules[j].name; j++) {
-            if (g_rules[j].is_patern &&
-                    is_right_ext(rule->deps[i], g_rules[j].patern.dst_ext)
-            ) {
-                char *src = malloc(strlen(noext) + strlen(g_rules[j].patern.src_ext) + 2);
-                sprintf(src, "%s.%s", noext, g_rules[j].patern.src_ext);
+    int is_patern = name[0] == '[' && name[strlen(name) - 1] == ']';
 
-                if (file_exists(src)) {
-                    dep = g_rules + j;
-                    free(src);
-                    break;
-                }
-                free(src);
-            }
+    if (is_patern) {
+        name[strlen(name) - 1] = '\0';
+        if (compute_patern(str_triml(str_trim(++name)), lnb, &src_ext, &dst_ext, &odir)) {
+            free(head);
+            return NULL;
         }
-
-        if (!dep) {
-            fprintf(stderr, "June: %s: %s: Rule not found\n", rule->name, rule->deps[i]);
-            free(noext);
-            return 1;
+    } else {
+        // several outputs share one recipe: a.c a.h: a.y
+        outs = str_split(name, ' ');
+        for (int i = 0; outs[i]; i++) {
+            if (is_valid_filename(outs[i]))
+                continue;
+            june_error("line %d: '%s': Invalid rule name", lnb, outs[i]);
+            for (int j = 0; outs[j]; j++)
+                free(outs[j]);
+            free(outs);
+            free(head);
+            return NULL;
         }
-
-        if (exec_rule_rec(dep, depth + 1, noext)) {
-            free(noext);
-            return 1;
+        if (!outs[0]) {
+            june_error("line %d: '': Invalid rule name", lnb);
+            free(outs);
+            free(head);
+            return NULL;
         }
-
-        free(noext);
     }
 
-    if (is_up_to_date(fname, rule)) {
-        return 0;
-    }
+    free(head);
 
-    if (!rule->cmds) {
-        printf("  No commands\n");
-        return 0;
-    }
+    int err = expand_list(line->ptr + sep + 1, line->len - sep - 1, lnb, &deps, NULL);
 
-    for (int i = 0; rule->cmds[i]; i++) {
-        char *cmd = expend_var0(strdup(rule->cmds[i]), fname);
-        printf("%s\n", cmd);
-        if (system(cmd)) {
-            fprintf(stderr, "June: %s: Command failed\n", rule->name);
-            free(cmd);
-            return 1;
+    for (int i = 0; !err && i < deps.count; i++) {
+        if (!is_valid_filename(deps.items[i])) {
+            june_error("line %d: '%s': Invalid dependency name", lnb, deps.items[i]);
+            err = 1;
         }
-        free(cmd);
     }
 
-    return 0;
+    if (err) {
+        if (is_patern) {
+            free(src_ext);
+            free(dst_ext);
+            free(odir);
+        } else {
+            for (int j = 0; outs[j]; j++)
+                free(outs[j]);
+            free(outs);
+        }
+        list_free(&deps);
+        return NULL;
+    }
+
+    rule = g_rules;
+    while (rule->name)
+        rule++;
+    rule->is_patern = is_patern;
+    rule->restat = restat;
+    if (is_patern) {
+        rule->patern.src_ext = src_ext;
+        rule->patern.dst_ext = dst_ext;
+        rule->patern.odir = odir;
+    } else {
+        rule->name = outs[0];
+    }
+    rule->outs = outs;
+    rule->deps = list_release(&deps);
+    rule->cmds = NULL;
+
+    return rule;
+}
+
+static int interp_file(jfile_t *jf, int blocks) {
+    // blocks: only record the @variant blocks
+    strlist_t *block = NULL;
+    rule_t *rule = NULL;
+    int variant = 0;
+    size_t pos = 0;
+    view_t sline;
+    int indent;
+    int lnb = 0;
+    char *line;
+
+    while ((lnb++, next_line(jf, &pos, &sline))) {
+        indent = tream_line(&sline);
+
+        if (sline.len == 0)
+            continue;
+
+        if (indent == 0) {
+            size_t sep = find_statement(&sline);
+
+            if (sep == sline.len) {
+                june_error("line %d: Invalid statement", lnb);
+                return 1;
+            }
+
+            variant = 0;
+            rule = NULL;
+
+            if (sline.ptr[sep] == '=') {
+                if (!blocks && interp_var(&sline, sep, lnb))
+                    return 1;
+            } else if (sline.len > 9 && !strncmp(sline.ptr, "@variant ", 9)) {
+                if (interp_variant(&sline, sep, lnb, &block))
+                    return 1;
+                variant = 1;
+            } else if (!blocks && !(rule = interp_rule(&sline, sep, lnb))) {
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (variant) {
+            char *name, *value;
+            if (!block)
+                continue;
+            line = strndup(sline.ptr, sline.len);
+            if (split_override(line, &name, &value)) {
+                june_error("line %d: Invalid variable override", lnb);
+                free(line);
+                return 1;
+            }
+            list_push(block, line);
+            free(name);
+            free(value);
+            continue;
+        }
+
+        if (blocks)
+            continue;
+
+        if (!rule) {
+            june_error("line %d: Command without rule", lnb);
+            return 1;
+        }
+
+        if (!(line = expand_vars(sline.ptr, sline.len, lnb)))
+            return 1;
+
+        int count = 0;
+
+        if (!rule->cmds) {
+            rule->cmds = malloc(sizeof(char *) * 2);
+        } else {
+            for (count = 0; rule->cmds[count]; count++);
+            rule->cmds = realloc(rule->cmds, sizeof(char *) * (count + 2));
+        }
+
+        rule->cmds[count] = line;
+        rule->cmds[count + 1] = NULL;
+    }
+
+    return 0;
+}
+
+/*********************************
+ *                              *
+ *       Rule Resolution        *
+ *                              *
+*********************************/
+
+/* g_files maps a path without its extension, spelled
+ * like in the jfile, to the extensions found on disk:
+ * "src/main" -> "c\0h\0\0". A directory is read once, the
+ * outputs of recipes are added as they are written. Only a
+ * recipe that does not write its target, like gen: writing
+ * foo.c, makes a miss read the directory again: undeclared
+ * files written next to a declared output are not seen
+*/
+
+static void index_add(char *path) {
+    char *noext = rm_ext(path);
+    char *ext = get_ext(path);
+    char *list, *old;
+    size_t len = 0;
+
+    ext = ext ? ext + 1 : "";
+    old = hmap_get(&g_files, noext);
+
+    if (old) {
+        for (char *e = old; *e; e += strlen(e) + 1) {
+            if (!strcmp(e, ext)) {
+                free(noext);
+                return;
+            }
+        }
+        for (len = 0; old[len]; len += strlen(old + len) + 1);
+    }
+
+    list = realloc(old, len + strlen(ext) + 2);
+    strcpy(list + len, ext);
+    list[len + strlen(ext) + 1] = '\0';
+
+    hmap_put(&g_files, noext, list);
+    free(noext);
+}
+
+static void index_dir(char *prefix) {
+    // prefix is the directory part of a path with its '/', or ""
+    struct dirent *ent;
+    char *path;
+    DIR *dir;
+    int fd;
+
+    hmap_put(&g_dirs, prefix, (void *) (intptr_t) (g_unlisted + 1));
+
+    if (*prefix) {
+        char *tmp = strdup(prefix);
+        tmp[strlen(tmp) - 1] = '\0';
+        fd = openat(g_dirfd, *tmp ? tmp : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        free(tmp);
+    } else {
+        fd = openat(g_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    if (fd == -1)
+        return;
+
+    if (!(dir = fdopendir(fd))) {
+        close(fd);
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        path = malloc(strlen(prefix) + strlen(ent->d_name) + 1);
+        sprintf(path, "%s%s", prefix, ent->d_name);
+        index_add(path);
+        free(path);
+    }
+
+    closedir(dir);
+}
+
+static int index_find(char *noext, char *ext) {
+    char *list = hmap_get(&g_files, noext);
+
+    for (; list && *list; list += strlen(list) + 1) {
+        if (!strcmp(list, ext))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int index_has(char *noext, char *ext) {
+    char *slash = strrchr(noext, '/');
+    char *prefix;
+    intptr_t read;
+    int found;
+
+    if (g_opt.virtual)
+        return 1;
+
+    prefix = slash ? strndup(noext, slash - noext + 1) : strdup("");
+
+    if (!(read = (intptr_t) hmap_get(&g_dirs, prefix)))
+        index_dir(prefix);
+
+    found = index_find(noext, ext);
+
+    if (!found && read && read - 1 < g_unlisted) {
+        index_dir(prefix);
+        found = index_find(noext, ext);
+    }
+
+    free(prefix);
+    return found;
+}
+
+static void index_rules(void) {
+    for (int i = 0; g_rules[i].name; i++) {
+        if (!g_rules[i].is_patern) {
+            for (int j = 0; g_rules[i].outs[j]; j++) {
+                if (!hmap_get(&g_names, g_rules[i].outs[j]))
+                    hmap_put(&g_names, g_rules[i].outs[j], g_rules + i);
+            }
+            continue;
+        }
+
+        rule_t **list = hmap_get(&g_paterns, g_rules[i].patern.dst_ext);
+        int count = 0;
+
+        while (list && list[count])
+            count++;
+
+        list = realloc(list, sizeof(rule_t *) * (count + 2));
+        list[count] = g_rules + i;
+        list[count + 1] = NULL;
+        hmap_put(&g_paterns, g_rules[i].patern.dst_ext, list);
+    }
+}
+
+static rule_t *explicit_src(char *noext, char *ext) {
+    // explicit rule writing noext.ext, a generated source
+    char path[4096];
+
+    if (!g_names.count || snprintf(path, sizeof(path), "%s.%s", noext, ext) >= (int) sizeof(path))
+        return NULL;
+
+    return hmap_get(&g_names, path);
+}
+
+static char *patern_stem(rule_t *rule, char *noext, int depth) {
+    // noext without the output directory of rule, NULL if it
+    // is not under it. Chained sources stay next to their stem
+    size_t len = strlen(rule->patern.odir);
+
+    if (len && (depth > 1 || strncmp(noext, rule->patern.odir, len)))
+        return NULL;
+
+    return noext + len;
+}
+
+static rule_t *find_patern(char *noext, char *ext, int depth) {
+    // patern producing noext.ext from an existing file, or from
+    // a file that another patern can produce (.y -> .c -> .o)
+    rule_t **list = hmap_get(&g_paterns, ext);
+    char *stem;
+
+    if (!list)
+        return NULL;
+
+    for (int i = 0; list[i]; i++) {
+        if (!(stem = patern_stem(list[i], noext, depth)))
+            continue;
+        if (index_has(stem, list[i]->patern.src_ext) ||
+                explicit_src(stem, list[i]->patern.src_ext))
+            return list[i];
+    }
+
+    if (depth >= PATERN_CHAIN_MAX)
+        return NULL;
+
+    for (int i = 0; list[i]; i++) {
+        if ((stem = patern_stem(list[i], noext, depth)) &&
+                find_patern(stem, list[i]->patern.src_ext, depth + 1))
+            return list[i];
+    }
+
+    return NULL;
+}
+
+static char *target_name(rule_t *rule, char *fname) {
+    if (!rule->is_patern)
+        return strdup(fname);
+
+    char *noext = rm_ext(fname);
+    char *out = malloc(strlen(rule->patern.odir) + strlen(noext) + strlen(rule->patern.dst_ext) + 2);
+    sprintf(out, "%s%s.%s", rule->patern.odir, noext, rule->patern.dst_ext);
+    free(noext);
+
+    return out;
+}
+
+static rule_t *find_rule(char *name) {
+    // explicit rule, or the default one if name is NULL
+    rule_t *rule;
+
+    if (name) {
+        if (!(rule = hmap_get(&g_names, name)))
+            june_error("'%s': Rule not found", name);
+        return rule;
+    }
+
+    for (rule = g_rules; rule->name && rule->is_patern; rule++);
+
+    if (!rule->name) {
+        june_error("No default rule found");
+        return NULL;
+    }
+
+    return rule;
+}
+
+static rule_t *resolve_dep(char *dep, char **fname) {
+    // rule building dep, *fname is allocated for patern instances
+    rule_t *rule = hmap_get(&g_names, dep);
+    char *ext = get_ext(dep);
+
+    *fname = NULL;
+
+    if (rule || !ext)
+        return rule;
+
+    *fname = rm_ext(dep);
+    if (!(rule = find_patern(*fname, ext + 1, 1))) {
+        free(*fname);
+        *fname = NULL;
+    } else {
+        // $0 is the stem, on the source side
+        char *stem = patern_stem(rule, *fname, 1);
+        memmove(*fname, stem, strlen(stem) + 1);
+    }
+
+    return rule;
+}
+
+static rule_t *chain_src(rule_t *rule, char *fname) {
+    // rule building the source of a patern instance
+    rule_t *src;
+
+    if (!rule->is_patern)
+        return NULL;
+
+    if ((src = explicit_src(fname, rule->patern.src_ext)))
+        return src;
+
+    if (g_opt.virtual)
+        return NULL;
+
+    src = find_patern(fname, rule->patern.src_ext, 2);
+    if (src && !strcmp(src->patern.src_ext, rule->patern.dst_ext))
+        return NULL;
+
+    return src;
+}
+
+/*********************************
+ *                              *
+ *         Build Graph          *
+ *                              *
+*********************************/
+
+/* resolved graph: one node per rule instance or plain
+ * file, reachable through any of its outputs. Nodes are
+ * also kept in topological order, dependencies first
+*/
+
+typedef struct node {
+    char *target;       // primary output or file path
+    rule_t *rule;       // NULL for plain files
+    char *fname;        // $0 of the rule instance
+    struct node **deps;
+    struct node **rdeps;
+    int ndeps;
+    int nrdeps;
+    int order;          // -1 while its dependencies are added
+    int mark;
+} node_t;
+
+typedef struct {
+    hmap_t nodes;
+    node_t **order;
+    int count;
+} graph_t;
+
+static void node_push(node_t ***array, int *count, node_t *node) {
+    // the array doubles when count is a power of two
+    if (!(*count & (*count - 1)))
+        *array = realloc(*array, sizeof(node_t *) * (*count ? *count * 2 : 1));
+    (*array)[(*count)++] = node;
+}
+
+static node_t *graph_node(graph_t *g, char *path, rule_t *rule, char *fname) {
+    node_t *node = calloc(1, sizeof(node_t));
+
+    node->target = strdup(path);
+    node->rule = rule;
+    node->fname = fname ? strdup(fname) : NULL;
+    node->order = -1;
+
+    hmap_put(&g->nodes, path, node);
+    return node;
+}
+
+static void graph_done(graph_t *g, node_t *node) {
+    node->order = g->count;
+    node_push(&g->order, &g->count, node);
+}
+
+static void graph_link(node_t *node, node_t *dep) {
+    node_push(&node->deps, &node->ndeps, dep);
+    node_push(&dep->rdeps, &dep->nrdeps, node);
+}
+
+static node_t *graph_file(graph_t *g, char *path) {
+    node_t *node = hmap_get(&g->nodes, path);
+
+    if (!node) {
+        node = graph_node(g, path, NULL, NULL);
+        graph_done(g, node);
+    }
+
+    return node;
+}
+
+static node_t *graph_add(graph_t *g, rule_t *rule, char *fname, int depth) {
+    char *target = target_name(rule, fname);
+    node_t *node = hmap_get(&g->nodes, target);
+    rule_t *drule;
+    char *dfname;
+
+    if (node || depth > 100) {
+        free(target);
+        return node;
+    }
+
+    node = graph_node(g, target, rule, fname);
+    free(target);
+
+    for (int i = 0; !rule->is_patern && rule->outs[i]; i++) {
+        if (!hmap_get(&g->nodes, rule->outs[i]))
+            hmap_put(&g->nodes, rule->outs[i], node);
+    }
+
+    if ((drule = chain_src(rule, fname))) {
+        node_t *dep = graph_add(g, drule, drule->is_patern ? fname : drule->name, depth + 1);
+        if (dep)
+            graph_link(node, dep);
+    } else if (rule->is_patern) {
+        char *in = malloc(strlen(fname) + strlen(rule->patern.src_ext) + 2);
+        sprintf(in, "%s.%s", fname, rule->patern.src_ext);
+        graph_link(node, graph_file(g, in));
+        free(in);
+    }
+
+    for (int i = 0; rule->deps[i]; i++) {
+        node_t *dep;
+        if ((drule = resolve_dep(rule->deps[i], &dfname)))
+            dep = graph_add(g, drule, dfname ? dfname : drule->name, depth + 1);
+        else
+            dep = graph_file(g, rule->deps[i]);
+        if (dep)
+            graph_link(node, dep);
+        free(dfname);
+    }
+
+    graph_done(g, node);
+    return node;
+}
+
+static void graph_build(graph_t *g, char **names) {
+    // names: requested rules, empty for the default one,
+    // NULL for every explicit rule of the jfile
+    memset(g, 0, sizeof(graph_t));
+
+    if (!names) {
+        for (int i = 0; g_rules[i].name; i++) {
+            if (!g_rules[i].is_patern)
+                graph_add(g, g_rules + i, g_rules[i].name, 0);
+        }
+        return;
+    }
+
+    if (!*names) {
+        rule_t *rule = g_rules;
+        while (rule->name && rule->is_patern)
+            rule++;
+        if (rule->name)
+            graph_add(g, rule, rule->name, 0);
+    }
+
+    for (int i = 0; names[i]; i++) {
+        rule_t *rule = hmap_get(&g_names, names[i]);
+        if (rule)
+            graph_add(g, rule, rule->name, 0);
+    }
+}
+
+static void graph_free(graph_t *g) {
+    for (int i = 0; i < g->count; i++) {
+        free(g->order[i]->target);
+        free(g->order[i]->fname);
+        free(g->order[i]->deps);
+        free(g->order[i]->rdeps);
+        free(g->order[i]);
+    }
+
+    free(g->order);
+    hmap_free(&g->nodes, NULL);
+}
+
+static int list_affected(char **paths, june_cb_t cb, void *arg) {
+    // every target downstream of paths, in build order
+    char *dir = strrchr(g_opt.file, '/');
+    size_t dlen = dir ? (size_t) (dir - g_opt.file + 1) : 0;
+    node_t **queue;
+    int head = 0, tail = 0;
+    graph_t g;
+
+    graph_build(&g, NULL);
+    queue = malloc(sizeof(node_t *) * (g.count + 1));
+
+    for (int i = 0; paths[i]; i++) {
+        // paths may be relative to the jfile or to the cwd
+        char *path = paths[i];
+        node_t *node;
+
+        if (dlen && !strncmp(path, g_opt.file, dlen))
+            path += dlen;
+        while (!strncmp(path, "./", 2))
+            path += 2;
+
+        if ((node = hmap_get(&g.nodes, path)) && !node->mark) {
+            node->mark = 1;
+            queue[tail++] = node;
+        }
+    }
+
+    // bit 1: queued as a seed, bit 2: reached from one
+    while (head < tail) {
+        node_t *node = queue[head++];
+        for (int i = 0; i < node->nrdeps; i++) {
+            node_t *rdep = node->rdeps[i];
+            if (!rdep->mark)
+                queue[tail++] = rdep;
+            rdep->mark |= 2;
+        }
+    }
+
+    for (int i = 0; i < g.count; i++) {
+        if (g.order[i]->mark & 2)
+            cb(g.order[i]->target, arg);
+    }
+
+    free(queue);
+    graph_free(&g);
+    return 0;
+}
+
+/*********************************
+ *                              *
+ *          Scan Phase          *
+ *                              *
+*********************************/
+
+/* before anything runs, every path the graph looks at
+ * is stat-ed by a pool of threads, so that a no-op build
+ * does not pay each round trip one after the other
+*/
+
+typedef struct {
+    hmap_t seen;
+    int dir;
+    int runs;
+    char **paths;
+    statent_t *ents;
+    size_t count;
+    size_t cap;
+    size_t next;
+} scan_t;
+
+static void scan_path(scan_t *scan, char *path) {
+    if (hmap_get(&scan->seen, path) || hmap_get(&g_stat, path))
+        return;
+
+    if (scan->count == scan->cap) {
+        scan->cap = scan->cap ? scan->cap * 2 : 256;
+        scan->paths = realloc(scan->paths, sizeof(char *) * scan->cap);
+    }
+
+    hmap_put(&scan->seen, path, (void *) 1);
+    scan->paths[scan->count++] = strdup(path);
+}
+
+static void *scan_worker(void *arg) {
+    scan_t *scan = arg;
+    struct stat buf;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED)) < scan->count) {
+        scan->ents[i].exists = fstatat(scan->dir, scan->paths[i], &buf, 0) != -1;
+        scan->ents[i].mtime = scan->ents[i].exists ? buf.st_mtime : -1;
+        scan->ents[i].runs = scan->runs;
+    }
+
+    return NULL;
+}
+
+static void scan_graph(char **names) {
+    pthread_t threads[SCAN_THREADS];
+    double start = get_time();
+    scan_t scan;
+    int count;
+
+    graph_t g;
+
+    memset(&scan, 0, sizeof(scan_t));
+    scan.dir = g_dirfd;
+    scan.runs = g_runs;
+    graph_build(&g, names);
+
+    for (int i = 0; i < g.count; i++) {
+        node_t *node = g.order[i];
+        scan_path(&scan, node->target);
+        if (!node->rule)
+            continue;
+        for (int j = 0; !node->rule->is_patern && node->rule->outs[j]; j++)
+            scan_path(&scan, node->rule->outs[j]);
+    }
+
+    graph_free(&g);
+
+    scan.ents = malloc(sizeof(statent_t) * (scan.count + 1));
+
+    // stat latency, not cpu, is the bottleneck here
+    count = scan.count / 16 + 1;
+    if (count > SCAN_THREADS)
+        count = SCAN_THREADS;
+
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(threads + i, NULL, scan_worker, &scan))
+            count = i;
+    }
+
+    scan_worker(&scan);
+
+    for (int i = 1; i < count; i++)
+        pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < scan.count; i++) {
+        hmap_put(&g_stat, scan.paths[i], scan.ents + i);
+        free(scan.paths[i]);
+    }
+
+    g_stats.scanned += scan.count;
+    g_stats.scan_time += get_time() - start;
+
+    if (ev_begin("scan")) {
+        ev_int("paths", scan.count);
+        ev_int("threads", count);
+        ev_dbl("duration", get_time() - start);
+        ev_end();
+    }
+
+    hmap_free(&scan.seen, NULL);
+    free(scan.paths);
+    free(g_scan_ents);
+    g_scan_ents = scan.ents;
+}
+
+/*********************************
+ *                              *
+ *     Early Cutoff (restat)    *
+ *                              *
+*********************************/
+
+/* for the outputs of @restat rules JUNE_LOG keeps a content
+ * hash and the mtime of the last real change, dependents
+ * compare against the latter: "mtime effective hash path".
+ * Each variant has its own JUNE_LOG.<name>
+*/
+
+static void log_load(void) {
+    char path[4096];
+    logent_t e;
+    FILE *f;
+
+    if (!(f = june_fopen(g_logname, "r")))
+        return;
+
+    while (fscanf(f, "%ld %ld %" SCNx64 " %4095s", &e.mtime, &e.effective, &e.hash, path) == 4) {
+        logent_t *ent = malloc(sizeof(logent_t));
+        *ent = e;
+        free(hmap_get(&g_log, path));
+        hmap_put(&g_log, path, ent);
+    }
+
+    fclose(f);
+}
+
+static void log_save(void) {
+    char tmp[4096];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_logname);
+
+    if (!g_log_dirty || !(f = june_fopen(tmp, "w")))
+        return;
+
+    for (size_t i = 0; i < g_log.size; i++) {
+        for (hnode_t *n = g_log.buckets[i]; n; n = n->next) {
+            logent_t *e = n->value;
+            fprintf(f, "%ld %ld %016" PRIx64 " %s\n", e->mtime, e->effective, e->hash, n->key);
+        }
+    }
+
+    if (fclose(f) == 0 && renameat(g_dirfd, tmp, g_dirfd, g_logname) == 0)
+        g_log_dirty = 0;
+}
+
+static long dep_last_modif(char *name) {
+    // mtime as seen by dependents
+    long mtime = file_last_modif(name);
+    logent_t *e = hmap_get(&g_log, name);
+
+    if (e && e->mtime == mtime)
+        return e->effective;
+
+    return mtime;
+}
+
+static int is_outdated(long mtime, char *dep, int *cutoff) {
+    if (mtime < dep_last_modif(dep))
+        return 1;
+
+    // only up to date thanks to an unchanged restat output
+    if (mtime < file_last_modif(dep))
+        *cutoff = 1;
+
+    return 0;
+}
+
+static logent_t *restat_before(char *target) {
+    // signature of the output before its recipe runs
+    long mtime = file_last_modif(target);
+    logent_t *e = hmap_get(&g_log, target);
+    logent_t *prev;
+
+    if (mtime == -1)
+        return NULL;
+
+    prev = malloc(sizeof(logent_t));
+
+    if (e && e->mtime == mtime) {
+        *prev = *e;
+    } else if (hash_file(g_dirfd, target, &prev->hash)) {
+        free(prev);
+        return NULL;
+    } else {
+        prev->mtime = mtime;
+        prev->effective = mtime;
+    }
+
+    return prev;
+}
+
+static int restat_after(char *target, logent_t *prev) {
+    // returns 1 if the output did not change
+    logent_t *e = malloc(sizeof(logent_t));
+    int same;
+
+    e->mtime = file_last_modif(target);
+
+    if (e->mtime == -1 || hash_file(g_dirfd, target, &e->hash)) {
+        free(e);
+        free(prev);
+        return 0;
+    }
+
+    same = prev && prev->hash == e->hash;
+    e->effective = same ? prev->effective : e->mtime;
+
+    free(hmap_get(&g_log, target));
+    hmap_put(&g_log, target, e);
+    g_log_dirty = 1;
+    free(prev);
+
+    return same;
+}
+
+/*********************************
+ *                              *
+ *          Job Output          *
+ *                              *
+*********************************/
+
+/* the output of a job is kept in a ring buffer of
+ * OUTPUT_RING bytes, older bytes go to a temp file.
+ * Everything is written at once when the job ends
+*/
+
+static FILE *temp_file(void) {
+    // tmpfile() without leaking the fd into children
+    char path[] = "/tmp/june-XXXXXX";
+    int fd = mkostemp(path, O_CLOEXEC);
+    FILE *f;
+
+    if (fd == -1)
+        return NULL;
+
+    unlink(path);
+
+    if (!(f = fdopen(fd, "w+")))
+        close(fd);
+
+    return f;
+}
+
+static void joblog_spill(joblog_t *log, char *data, size_t len) {
+    if (!log->spill && !(log->spill = temp_file()))
+        return;
+    fwrite(data, 1, len, log->spill);
+    log->spilled += len;
+}
+
+static void joblog_write(joblog_t *log, char *data, size_t len) {
+    if (!log->ring)
+        log->ring = malloc(OUTPUT_RING);
+
+    if (len > OUTPUT_RING) {
+        joblog_write(log, data, len - OUTPUT_RING);
+        data += len - OUTPUT_RING;
+        len = OUTPUT_RING;
+    }
+
+    // evict the oldest bytes to make room
+    while (log->len + len > OUTPUT_RING) {
+        size_t n = log->len + len - OUTPUT_RING;
+        if (n > OUTPUT_RING - log->start)
+            n = OUTPUT_RING - log->start;
+        joblog_spill(log, log->ring + log->start, n);
+        log->start = (log->start + n) % OUTPUT_RING;
+        log->len -= n;
+    }
+
+    while (len) {
+        size_t end = (log->start + log->len) % OUTPUT_RING;
+        size_t n = OUTPUT_RING - end < len ? OUTPUT_RING - end : len;
+        memcpy(log->ring + end, data, n);
+        log->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void write_all(int fd, char *data, size_t len) {
+    ssize_t n;
+    while (len && (n = write(fd, data, len)) > 0) {
+        data += n;
+        len -= n;
+    }
+}
+
+static void joblog_flush(joblog_t *log, char *target) {
+    size_t skip = 0;
+
+    fflush(stdout);
+
+    if (g_opt.quiet && log->spilled + log->len > OUTPUT_QUIET) {
+        skip = log->spilled + log->len - OUTPUT_QUIET;
+        printf("June: %s: %zu bytes of output truncated\n", target, skip);
+        fflush(stdout);
+    } else if (log->spilled) {
+        char buf[4096];
+        size_t n;
+        rewind(log->spill);
+        while ((n = fread(buf, 1, sizeof(buf), log->spill)) > 0)
+            write_all(log->fd, buf, n);
+    }
+
+    skip = skip > log->spilled ? skip - log->spilled : 0;
+
+    // do not start the tail in the middle of a line
+    while (skip && skip < log->len && log->ring[(log->start + skip - 1) % OUTPUT_RING] != '\n')
+        skip++;
+
+    for (size_t done = skip; done < log->len;) {
+        size_t pos = (log->start + done) % OUTPUT_RING;
+        size_t n = OUTPUT_RING - pos < log->len - done ? OUTPUT_RING - pos : log->len - done;
+        write_all(log->fd, log->ring + pos, n);
+        done += n;
+    }
+
+    if (log->spill)
+        fclose(log->spill);
+
+    log->spill = NULL;
+    log->spilled = 0;
+    log->start = 0;
+    log->len = 0;
+}
+
+static int capture_command(char *cmd, joblog_t *out, joblog_t *err, struct rusage *ru) {
+    // run cmd with its stdout going to out and stderr to err
+    int fds[4] = {-1, -1, -1, -1}, status, dir = g_dirfd, exited = 0, open = 2;
+    joblog_t *logs[] = {out, err};
+    size_t left = SIZE_MAX;
+    struct pollfd pfd[2];
+    char buf[4096];
+    ssize_t len;
+    pid_t pid;
+
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        return -1;
+
+    if (pipe2(fds + 2, O_CLOEXEC) == -1 || (pid = fork()) == -1) {
+        for (int i = 0; i < 4; i++)
+            close(fds[i]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // the pipes themselves are closed by exec
+        dup2(fds[1], 1);
+        dup2(fds[3], 2);
+        if (fchdir(dir))
+            _exit(127);
+        execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    close(fds[3]);
+
+    pfd[0].fd = fds[0];
+    pfd[1].fd = fds[2];
+    pfd[0].events = pfd[1].events = POLLIN;
+
+    /* a process put in the background (server &) keeps the
+     * pipes open after the shell exits: only what it already
+     * wrote is read then, it gets EPIPE on later writes
+    */
+    while (open && left) {
+        int ready;
+
+        // checked on every read, a chatty background process
+        // must not keep june from seeing the shell exit
+        if (!exited && wait4(pid, &status, WNOHANG, ru) == pid) {
+            // at most one pipe buffer more
+            exited = 1;
+            left = 1 << 16;
+        }
+
+        ready = poll(pfd, 2, exited ? 0 : 100);
+
+        if ((ready == -1 && errno != EINTR) || (ready <= 0 && exited))
+            break;
+
+        for (int i = 0; ready > 0 && i < 2; i++) {
+            if (pfd[i].fd == -1 || !pfd[i].revents)
+                continue;
+            if ((len = read(pfd[i].fd, buf, sizeof(buf))) <= 0) {
+                close(pfd[i].fd);
+                pfd[i].fd = -1;
+                open--;
+                continue;
+            }
+            joblog_write(logs[i], buf, len);
+            if (exited)
+                left = (size_t) len < left ? left - len : 0;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (pfd[i].fd != -1)
+            close(pfd[i].fd);
+    }
+
+    if (!exited && wait4(pid, &status, 0, ru) == -1)
+        return -1;
+
+    return status;
+}
+
+/*********************************
+ *                              *
+ *      Execution Backends      *
+ *                              *
+*********************************/
+
+/* a backend runs the expanded recipe of a rule, it stops
+ * at the first failing command and returns its status.
+ * The local one forks sh -c for each command, the remote
+ * one ships the action to a june worker (--remote=<socket>).
+ * June runs one action at a time, so there is a single
+ * worker connection and no pool: parallel builds would go
+ * through several june processes, each with its --remote
+*/
+
+typedef struct {
+    char *target;
+    char **cmds;        // expanded commands
+    char **inputs;      // declared inputs found on disk
+    char **outputs;
+} action_t;
+
+typedef struct backend {
+    char *name;
+    int (*open)(char *arg);
+    int (*run)(action_t *act);
+    void (*close)(void);
+} backend_t;
+
+static void command_begin(char *cmd) {
+    if (!g_opt.quiet) {
+        joblog_write(&g_joblog, cmd, strlen(cmd));
+        joblog_write(&g_joblog, "\n", 1);
+    }
+}
+
+static void command_done(char *cmd, int status, double duration, struct rusage *ru) {
+    g_stats.commands++;
+
+    if (ev_begin("command")) {
+        ev_str("command", cmd);
+        ev_int("status", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        ev_dbl("duration", duration);
+        ev_dbl("utime", ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6);
+        ev_dbl("stime", ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6);
+        ev_int("maxrss", ru->ru_maxrss);
+        ev_end();
+    }
+}
+
+static int local_run(action_t *act) {
+    int status = 0;
+
+    for (int i = 0; act->cmds[i] && !status; i++) {
+        double start = get_time();
+        struct rusage ru;
+
+        command_begin(act->cmds[i]);
+        memset(&ru, 0, sizeof(ru));
+        status = capture_command(act->cmds[i], &g_joblog, &g_errlog, &ru);
+        command_done(act->cmds[i], status, get_time() - start, &ru);
+    }
+
+    return status;
+}
+
+/* the protocol is made of text lines, some followed by raw
+ * bytes. For each action the client lists its inputs with
+ * their hash, the worker answers with the hashes missing
+ * from its store, and only those are uploaded:
+ *
+ *   > action <inputs> <cmds> <outputs>
+ *   > input <hash> <size> <mode> <path>     (for each input)
+ *   < need <hash>                           (for each missing one)
+ *   < ready
+ *   > blob <hash> <size> + bytes            (for each need)
+ *   > cmd <size> + bytes                    (for each command)
+ *   > out <path>                            (for each output)
+ *   < log <size> + bytes                    (stdout)
+ *   < err <size> + bytes                    (stderr)
+ *   < status <status> <duration> <utime> <stime> <maxrss>
+ *   < file <mode> <size> <path> + bytes     (on success)
+ *   < none <path>                           (output not written)
+ *   < end
+ *
+ * files and nones must name declared outputs, and after a
+ * successful recipe cover all of them
+*/
+
+static int count_strs(char **strs) {
+    int count = 0;
+    while (strs[count])
+        count++;
+    return count;
+}
+
+static int copy_bytes(FILE *in, FILE *out, size_t size) {
+    // out may be NULL to drop the bytes
+    char buf[65536];
+    size_t n;
+
+    while (size) {
+        n = size < sizeof(buf) ? size : sizeof(buf);
+        if (fread(buf, 1, n, in) != n)
+            return 1;
+        if (out && fwrite(buf, 1, n, out) != n)
+            return 1;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int read_line(FILE *in, char *line, size_t size) {
+    // strips the newline, returns 1 at end of stream
+    size_t len;
+
+    if (!fgets(line, size, in))
+        return 1;
+
+    len = strlen(line);
+    if (len && line[len - 1] == '\n')
+        line[len - 1] = '\0';
+
+    return 0;
+}
+
+static int make_parents(int dir, char *path) {
+    // mkdir -p of the directory part of path
+    char *tmp = strdup(path);
+
+    for (char *s = strchr(tmp + 1, '/'); s; s = strchr(s + 1, '/')) {
+        *s = '\0';
+        if (mkdirat(dir, tmp, 0755) && errno != EEXIST) {
+            free(tmp);
+            return 1;
+        }
+        *s = '/';
+    }
+
+    free(tmp);
+    return 0;
+}
+
+/* a dead worker is reported, not fatal: writes use
+ * MSG_NOSIGNAL rather than ignoring SIGPIPE for the
+ * whole host process
+*/
+
+static ssize_t remote_write(void *cookie, const char *buf, size_t size) {
+    return send((int) (intptr_t) cookie, buf, size, MSG_NOSIGNAL);
+}
+
+static int remote_cookie_close(void *cookie) {
+    return close((int) (intptr_t) cookie);
+}
+
+static int remote_open(char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return 1;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(fd);
+        return 1;
+    }
+
+    g_remote.in = fdopen(fd, "r");
+    g_remote.out = fopencookie((void *) (intptr_t) fcntl(fd, F_DUPFD_CLOEXEC, 0), "w",
+            (cookie_io_functions_t) {NULL, remote_write, NULL, remote_cookie_close});
+
+    return 0;
+}
+
+static void remote_close(void) {
+    if (g_remote.in)
+        fclose(g_remote.in);
+    if (g_remote.out)
+        fclose(g_remote.out);
+}
+
+static int remote_upload(FILE *out, char *path, uint64_t hash, size_t size) {
+    FILE *f = june_fopen(path, "r");
+    int ret;
+
+    if (!f)
+        return 1;
+
+    fprintf(out, "blob %016" PRIx64 " %zu\n", hash, size);
+    ret = copy_bytes(f, out, size);
+    fclose(f);
+
+    return ret;
+}
+
+static int remote_fetch(FILE *in, char *path, int mode, size_t size) {
+    // written aside and renamed, like JUNE_LOG
+    char *tmp = malloc(strlen(path) + 6);
+    FILE *f;
+    int ret;
+
+    sprintf(tmp, "%s.part", path);
+    make_parents(g_dirfd, path);
+
+    if (!(f = june_fopen(tmp, "w"))) {
+        ret = copy_bytes(in, NULL, size) ? -1 : 1;
+        free(tmp);
+        return ret;
+    }
+
+    ret = copy_bytes(in, f, size) ? -1 : 0;
+
+    if (fclose(f) || ret || fchmodat(g_dirfd, tmp, mode, 0) ||
+            renameat(g_dirfd, tmp, g_dirfd, path)) {
+        unlinkat(g_dirfd, tmp, 0);
+        ret = ret ? ret : 1;
+    }
+
+    free(tmp);
+    return ret;
+}
+
+static int output_index(action_t *act, char *path) {
+    for (int i = 0; act->outputs[i]; i++) {
+        if (!strcmp(act->outputs[i], path))
+            return i;
+    }
+    return -1;
+}
+
+static int remote_run(action_t *act) {
+    int ninputs = count_strs(act->inputs), ncmds = count_strs(act->cmds);
+    FILE *in = g_remote.in, *out = g_remote.out;
+    uint64_t *hashes = calloc(ninputs + 1, sizeof(uint64_t));
+    size_t *sizes = calloc(ninputs + 1, sizeof(size_t));
+    char *need = calloc(ninputs + 1, 1);
+    char *got = calloc(count_strs(act->outputs) + 1, 1);
+    char line[4200];
+    int status = 0;
+    int ncmd = 0;
+
+    fprintf(out, "action %d %d %d\n", ninputs, ncmds, count_strs(act->outputs));
+
+    for (int i = 0; i < ninputs; i++) {
+        struct stat st;
+        if (fstatat(g_dirfd, act->inputs[i], &st, 0) || hash_file(g_dirfd, act->inputs[i], hashes + i)) {
+            june_error("%s: %s: Failed to read input", act->target, act->inputs[i]);
+            st.st_size = 0;
+            st.st_mode = 0644;
+        }
+        sizes[i] = st.st_size;
+        fprintf(out, "input %016" PRIx64 " %zu %o %s\n",
+                hashes[i], sizes[i], st.st_mode & 0777, act->inputs[i]);
+    }
+
+    fflush(out);
+
+    // collect every need before uploading anything
+    while (!read_line(in, line, sizeof(line)) && strcmp(line, "ready")) {
+        uint64_t hash;
+        if (sscanf(line, "need %" SCNx64, &hash) != 1)
+            goto lost;
+        for (int i = 0; i < ninputs; i++) {
+            if (hashes[i] == hash && !need[i]) {
+                need[i] = 1;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < ninputs; i++) {
+        if (!need[i]) {
+            g_stats.deduped++;
+            continue;
+        }
+        if (remote_upload(out, act->inputs[i], hashes[i], sizes[i]))
+            goto lost;
+        g_stats.uploaded++;
+    }
+
+    for (int i = 0; i < ncmds; i++) {
+        fprintf(out, "cmd %zu\n", strlen(act->cmds[i]));
+        fputs(act->cmds[i], out);
+    }
+
+    for (int i = 0; act->outputs[i]; i++)
+        fprintf(out, "out %s\n", act->outputs[i]);
+
+    if (fflush(out))
+        goto lost;
+
+    command_begin(act->cmds[0]);
+
+    while (!read_line(in, line, sizeof(line)) && strcmp(line, "end")) {
+        struct rusage ru;
+        double duration, utime, stime;
+        size_t size;
+        int mode, len;
+
+        if (sscanf(line, "log %zu", &size) == 1 || sscanf(line, "err %zu", &size) == 1) {
+            joblog_t *log = *line == 'l' ? &g_joblog : &g_errlog;
+            char buf[4096];
+            while (size) {
+                size_t n = size < sizeof(buf) ? size : sizeof(buf);
+                if (fread(buf, 1, n, in) != n)
+                    goto lost;
+                joblog_write(log, buf, n);
+                size -= n;
+            }
+        } else if (sscanf(line, "status %d %lf %lf %lf %ld", &status,
+                    &duration, &utime, &stime, &ru.ru_maxrss) == 5) {
+            ru.ru_utime.tv_sec = (long) utime;
+            ru.ru_utime.tv_usec = (utime - (long) utime) * 1e6;
+            ru.ru_stime.tv_sec = (long) stime;
+            ru.ru_stime.tv_usec = (stime - (long) stime) * 1e6;
+            command_done(act->cmds[ncmd], status, duration, &ru);
+            if (!status && ++ncmd < ncmds)
+                command_begin(act->cmds[ncmd]);
+        } else if (sscanf(line, "file %o %zu %n", &mode, &size, &len) == 2) {
+            // never write a path the action did not declare
+            int out = output_index(act, line + len), ret;
+            if (out < 0 || got[out])
+                goto lost;
+            got[out] = 1;
+            if ((ret = remote_fetch(in, line + len, mode, size)) < 0)
+                goto lost;
+            if (ret)
+                june_error("%s: %s: Failed to write output", act->target, line + len);
+        } else if (!strncmp(line, "none ", 5)) {
+            int out = output_index(act, line + 5);
+            if (out < 0 || got[out])
+                goto lost;
+            got[out] = 1;
+        } else {
+            goto lost;
+        }
+    }
+
+    if (ferror(in) || feof(in))
+        goto lost;
+
+    // a successful recipe accounts for every output
+    for (int i = 0; !status && act->outputs[i]; i++) {
+        if (!got[i])
+            goto lost;
+    }
+
+    free(hashes);
+    free(sizes);
+    free(need);
+    free(got);
+
+    return status;
+
+    lost:
+    june_error("%s: Lost connection with the worker", act->target);
+    free(hashes);
+    free(sizes);
+    free(need);
+    free(got);
+
+    return -1;
+}
+
+static backend_t g_backends[] = {
+    {"local", NULL, local_run, NULL},
+    {"remote", remote_open, remote_run, remote_close},
+    {NULL, NULL, NULL, NULL}
+};
+
+
+/*********************************
+ *                              *
+ *         Remote Worker        *
+ *                              *
+*********************************/
+
+/* june --worker=<socket>, or june-worker <socket>, serves
+ * actions on a Unix socket. Inputs are kept by hash in
+ * <socket>.d/cas, each action runs in a fresh directory
+ * next to it where its inputs are copied. It is a mode
+ * of the june binary, not part of libjune
+*/
+
+#ifndef JUNE_NO_MAIN
+
+static int worker_path_ok(char *path) {
+    // no absolute path nor '..' escaping the sandbox
+    if (*path == '/' || !*path)
+        return 0;
+
+    for (char *s = path; s; s = strchr(s, '/')) {
+        s += *s == '/';
+        if (!strncmp(s, "..", 2) && (s[2] == '/' || !s[2]))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void worker_rmtree(char *path) {
+    struct dirent *ent;
+    DIR *dir;
+
+    if ((dir = opendir(path))) {
+        while ((ent = readdir(dir))) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+            char *sub = malloc(strlen(path) + strlen(ent->d_name) + 2);
+            sprintf(sub, "%s/%s", path, ent->d_name);
+            worker_rmtree(sub);
+            free(sub);
+        }
+        closedir(dir);
+        rmdir(path);
+    } else {
+        unlink(path);
+    }
+}
+
+static int worker_store(FILE *in, char *root, uint64_t hash, size_t size) {
+    // blobs are checked against their hash before use
+    char tmp[4200], path[4200];
+    uint64_t check;
+    FILE *f;
+
+    sprintf(tmp, "%s/cas/.%d", root, getpid());
+    sprintf(path, "%s/cas/%016" PRIx64, root, hash);
+
+    if (!(f = fopen(tmp, "w")))
+        return copy_bytes(in, NULL, size) ? -1 : 0;
+
+    if (copy_bytes(in, f, size)) {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+
+    if (fclose(f) || hash_file(AT_FDCWD, tmp, &check) || check != hash || rename(tmp, path))
+        unlink(tmp);
+
+    return 0;
+}
+
+static int worker_copy(char *src, char *dst, int mode) {
+    FILE *in, *out;
+    struct stat st;
+    int ret;
+
+    if (make_parents(AT_FDCWD, dst) || stat(src, &st) || !(in = fopen(src, "r")))
+        return 1;
+
+    if (!(out = fopen(dst, "w"))) {
+        fclose(in);
+        return 1;
+    }
+
+    ret = copy_bytes(in, out, st.st_size);
+    fclose(in);
+
+    return fclose(out) || ret || chmod(dst, mode);
+}
+
+static int worker_command(FILE *out, char *dir, char *cmd) {
+    // runs cmd in dir and sends its output and status
+    double start = get_time();
+    FILE *log = temp_file(), *err = temp_file();
+    char *names[] = {"log", "err"};
+    FILE *logs[] = {log, err};
+    struct rusage ru;
+    int status = -1;
+    long size = 0;
+    pid_t pid;
+
+    memset(&ru, 0, sizeof(ru));
+
+    if (log && err && (pid = fork()) == 0) {
+        if (chdir(dir))
+            _exit(127);
+        dup2(fileno(log), 1);
+        dup2(fileno(err), 2);
+        execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+        _exit(127);
+    }
+
+    if (log && err && pid != -1 && wait4(pid, &status, 0, &ru) == -1)
+        status = -1;
+
+    for (int i = 0; i < 2; i++) {
+        if (!logs[i])
+            continue;
+        if ((size = ftell(logs[i])) > 0) {
+            rewind(logs[i]);
+            fprintf(out, "%s %ld\n", names[i], size);
+            copy_bytes(logs[i], out, size);
+        }
+        fclose(logs[i]);
+    }
+
+    fprintf(out, "status %d %.6f %.6f %.6f %ld\n", status, get_time() - start,
+            ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+            ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6, ru.ru_maxrss);
+
+    return status;
+}
+
+static void worker_send(FILE *out, char *dir, char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    struct stat st;
+    FILE *f;
+
+    sprintf(path, "%s/%s", dir, name);
+
+    if (!stat(path, &st) && S_ISREG(st.st_mode) && (f = fopen(path, "r"))) {
+        fprintf(out, "file %o %ld %s\n", st.st_mode & 0777, (long) st.st_size, name);
+        copy_bytes(f, out, st.st_size);
+        fclose(f);
+    } else {
+        fprintf(out, "none %s\n", name);
+    }
+
+    free(path);
+}
+
+static int worker_action(FILE *in, FILE *out, char *root, int ninputs, int ncmds, int nouts) {
+    char **paths = calloc(ninputs + 1, sizeof(char *));
+    char **cmds = calloc(ncmds + 1, sizeof(char *));
+    char **outs = calloc(nouts + 1, sizeof(char *));
+    uint64_t *hashes = calloc(ninputs + 1, sizeof(uint64_t));
+    int *modes = calloc(ninputs + 1, sizeof(int));
+    char line[4200], dir[4200], *path;
+    int ret = 1, needed = 0, status = 0;
+    hmap_t asked = {0};
+
+    for (int i = 0; i < ninputs; i++) {
+        size_t size;
+        int len;
+        if (read_line(in, line, sizeof(line)) || sscanf(line, "input %" SCNx64 " %zu %o %n",
+                hashes + i, &size, modes + i, &len) != 3)
+            goto end;
+        paths[i] = strdup(line + len);
+    }
+
+    for (int i = 0; i < ninputs; i++) {
+        sprintf(line, "%s/cas/%016" PRIx64, root, hashes[i]);
+        if (access(line, F_OK) && !hmap_get(&asked, line)) {
+            hmap_put(&asked, line, (void *) 1);
+            fprintf(out, "need %016" PRIx64 "\n", hashes[i]);
+            needed++;
+        }
+    }
+
+    fputs("ready\n", out);
+    fflush(out);
+
+    for (int i = 0; i < needed; i++) {
+        uint64_t hash;
+        size_t size;
+        if (read_line(in, line, sizeof(line)) ||
+                sscanf(line, "blob %" SCNx64 " %zu", &hash, &size) != 2 ||
+                worker_store(in, root, hash, size))
+            goto end;
+    }
+
+    for (int i = 0; i < ncmds; i++) {
+        size_t size;
+        if (read_line(in, line, sizeof(line)) || sscanf(line, "cmd %zu", &size) != 1)
+            goto end;
+        cmds[i] = malloc(size + 1);
+        if (fread(cmds[i], 1, size, in) != size)
+            goto end;
+        cmds[i][size] = '\0';
+    }
+
+    for (int i = 0; i < nouts; i++) {
+        if (read_line(in, line, sizeof(line)) || strncmp(line, "out ", 4))
+            goto end;
+        outs[i] = strdup(line + 4);
+    }
+
+    sprintf(dir, "%s/XXXXXX", root);
+    if (!mkdtemp(dir))
+        goto end;
+
+    for (int i = 0; i < ninputs; i++) {
+        if (!worker_path_ok(paths[i]))
+            continue;
+        path = malloc(strlen(dir) + strlen(paths[i]) + 2);
+        sprintf(path, "%s/%s", dir, paths[i]);
+        sprintf(line, "%s/cas/%016" PRIx64, root, hashes[i]);
+        worker_copy(line, path, modes[i]);
+        free(path);
+    }
+
+    for (int i = 0; i < nouts; i++) {
+        if (!worker_path_ok(outs[i]))
+            continue;
+        path = malloc(strlen(dir) + strlen(outs[i]) + 2);
+        sprintf(path, "%s/%s", dir, outs[i]);
+        make_parents(AT_FDCWD, path);
+        free(path);
+    }
+
+    for (int i = 0; i < ncmds && !status; i++)
+        status = worker_command(out, dir, cmds[i]);
+
+    for (int i = 0; i < nouts && !status; i++) {
+        if (worker_path_ok(outs[i]))
+            worker_send(out, dir, outs[i]);
+        else
+            fprintf(out, "none %s\n", outs[i]);
+    }
+
+    fputs("end\n", out);
+    ret = fflush(out) != 0;
+    worker_rmtree(dir);
+
+    end:
+    for (int i = 0; i < ninputs; i++)
+        free(paths[i]);
+    for (int i = 0; i < ncmds; i++)
+        free(cmds[i]);
+    for (int i = 0; i < nouts; i++)
+        free(outs[i]);
+    free(paths);
+    free(cmds);
+    free(outs);
+    free(hashes);
+    free(modes);
+    hmap_free(&asked, NULL);
+
+    return ret;
+}
+
+static void worker_serve(int fd, char *root) {
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    int ninputs, ncmds, nouts;
+    char line[256];
+
+    signal(SIGCHLD, SIG_DFL);
+
+    while (!read_line(in, line, sizeof(line)) &&
+            sscanf(line, "action %d %d %d", &ninputs, &ncmds, &nouts) == 3 &&
+            !worker_action(in, out, root, ninputs, ncmds, nouts));
+
+    fclose(in);
+    fclose(out);
+}
+
+static int worker_main(char *path) {
+    struct sockaddr_un addr;
+    char *root;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        june_error("%s: Socket path too long", path);
+        return 1;
+    }
+
+    root = malloc(strlen(path) + 8);
+    sprintf(root, "%s.d", path);
+    mkdir(root, 0755);
+    strcat(root, "/cas");
+    mkdir(root, 0755);
+    root[strlen(root) - 4] = '\0';
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+            bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 16)) {
+        june_error("%s: Failed to listen", path);
+        free(root);
+        return 1;
+    }
+
+    // one process per client, reaped by the kernel
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client == -1)
+            continue;
+        if (fork() == 0) {
+            close(fd);
+            worker_serve(client, root);
+            _exit(0);
+        }
+        close(client);
+    }
+}
+
+#endif
+
+/*********************************
+ *                              *
+ *        Rule Execution        *
+ *                              *
+*********************************/
+
+static char *expend_var0(char *line, char *val) {
+    char *tmp, *start = strstr(line, "$0");
+
+    if (!start) {
+        return line;
+    }
+
+    tmp = malloc(strlen(line) + strlen(val));
+    strncpy(tmp, line, start - line);
+    strcpy(tmp + (start - line), val);
+    strcpy(tmp + (start - line) + strlen(val), start + 2);
+
+    free(line);
+    return expend_var0(tmp, val);
+}
+
+static int is_up_to_date(char *name, rule_t *rule) {
+    int cutoff = 0;
+
+    if (g_opt.virtual) {
+        return 0;
+    }
+
+    // a patern instance is named by its stem, not its output
+    char *out = target_name(rule, name);
+    long mtime = file_last_modif(out);
+
+    free(out);
+
+    // one decision for all the outputs, the oldest one counts
+    for (int i = 0; !rule->is_patern && rule->outs[i]; i++) {
+        if (!file_exists(rule->outs[i])) {
+            return 0;
+        }
+        if (file_last_modif(rule->outs[i]) < mtime) {
+            mtime = file_last_modif(rule->outs[i]);
+        }
+    }
+
+    for (int i = 0; rule->deps[i]; i++) {
+        if (!file_exists(rule->deps[i])) {
+            return 0;
+        }
+        if (is_outdated(mtime, rule->deps[i], &cutoff)) {
+            return 0;
+        }
+    }
+
+    if (!rule->is_patern) {
+        g_stats.cutoff += cutoff;
+        return 1;
+    }
+
+    char *noext = rm_ext(name);
+    char *in = malloc(strlen(noext) + strlen(rule->patern.src_ext) + 2);
+    out = target_name(rule, name);
+
+    sprintf(in, "%s.%s", noext, rule->patern.src_ext);
+
+    if (!file_exists(in) || !file_exists(out) || is_outdated(file_last_modif(out), in, &cutoff)) {
+        free(noext);
+        free(in);
+        free(out);
+        return 0;
+    }
+
+    free(noext);
+    free(in);
+    free(out);
+
+    g_stats.cutoff += cutoff;
+    return 1;
+}
+
+static void action_inputs(rule_t *rule, char *fname, strlist_t *out) {
+    // the pattern source and the dependencies found on disk
+    if (rule->is_patern) {
+        char *src = malloc(strlen(fname) + strlen(rule->patern.src_ext) + 2);
+        sprintf(src, "%s.%s", fname, rule->patern.src_ext);
+        if (file_exists(src))
+            list_push(out, src);
+        else
+            free(src);
+    }
+
+    for (int i = 0; rule->deps[i]; i++) {
+        if (file_exists(rule->deps[i]))
+            list_push(out, strdup(rule->deps[i]));
+    }
+}
+
+static int exec_rule_rec(rule_t *rule, int depth, char *fname);
+
+static int run_rule(rule_t *rule, int depth, char *fname) {
+    /*
+    for (int j = 0; j < depth; j++)
+        putchar(' ');
+    if (rule->is_patern)
+        printf("[%s.%s -> %s.%s]\n", fname, rule->patern.src_ext, fname, rule->patern.dst_ext);
+    else
+        printf("[%s]\n", rule->name);
+    */
+
+    if (depth > 100) {
+        june_error("%s: Recursion limit reached", rule->name);
+        return JS_FAILED;
+    }
+
+    rule_t *dep;
+    char *dfname;
+
+    if ((dep = chain_src(rule, fname)) &&
+            exec_rule_rec(dep, depth + 1, dep->is_patern ? fname : dep->name))
+        return JS_FAILED;
+
+    for (int i = 0; rule->deps[i]; i++) {
+        if (!(dep = resolve_dep(rule->deps[i], &dfname))) {
+            // plain source file
+            if (file_exists(rule->deps[i]))
+                continue;
+            june_error("%s: %s: Rule not found", rule->name, rule->deps[i]);
+            return JS_FAILED;
+        }
+
+        if (exec_rule_rec(dep, depth + 1, dfname ? dfname : dep->name)) {
+            free(dfname);
+            return JS_FAILED;
+        }
+
+        free(dfname);
+    }
+
+    if (is_up_to_date(fname, rule)) {
+        return JS_UP_TO_DATE;
+    }
+
+    if (!rule->cmds) {
+        return JS_NO_CMDS;
+    }
+
+    char *target = target_name(rule, fname);
+    char *single[] = {target, NULL};
+    char **outs = rule->is_patern ? single : rule->outs;
+    int restat = rule->restat && !g_opt.virtual;
+    logent_t *prev[MAX_OUTS] = {NULL};
+    int unchanged = restat;
+    int missing = 0;
+    double start;
+
+    for (int i = 0; restat && outs[i] && i < MAX_OUTS; i++)
+        prev[i] = restat_before(outs[i]);
+
+    start = get_time();
+
+    strlist_t cmds = {0}, inputs = {0};
+    action_t act = {target, NULL, NULL, outs};
+    int status;
+
+    for (int i = 0; rule->cmds[i]; i++)
+        list_push(&cmds, expend_var0(strdup(rule->cmds[i]), fname));
+    action_inputs(rule, fname, &inputs);
+
+    for (int i = 0; !g_opt.virtual && outs[i]; i++)
+        make_parents(g_dirfd, outs[i]);
+
+    char *none[] = {NULL};
+    act.cmds = cmds.items;
+    act.inputs = inputs.items ? inputs.items : none;
+    status = g_backend->run(&act);
+    g_runs++;
+
+    list_free(&cmds);
+    list_free(&inputs);
+    joblog_flush(&g_joblog, target);
+    joblog_flush(&g_errlog, target);
+
+    if (status) {
+        june_error("%s: Command failed", rule->name);
+        g_unlisted++;
+        for (int j = 0; j < MAX_OUTS; j++)
+            free(prev[j]);
+        free(target);
+        return JS_FAILED;
+    }
+
+    for (int i = 0; outs[i]; i++) {
+        stat_forget(outs[i]);
+        index_add(outs[i]);
+        if (!g_opt.virtual && file_last_modif(outs[i]) == -1)
+            missing = 1;
+        if (restat && (i >= MAX_OUTS || !restat_after(outs[i], prev[i])))
+            unchanged = 0;
+    }
+
+    g_unlisted += missing;
+
+    // one line per job, the format --shard-log reads
+    if (g_opt.durations && !g_opt.virtual)
+        fprintf(g_opt.durations, "%.3f %s\n", get_time() - start, target);
+
+    if (unchanged) {
+        g_stats.unchanged++;
+        if (!g_opt.quiet)
+            printf("June: %s: Unchanged\n", target);
+        if (ev_begin("unchanged")) {
+            ev_str("target", target);
+            ev_end();
+        }
+    }
+
+    free(target);
+
+    return JS_BUILT;
+}
+
+static int exec_rule_rec(rule_t *rule, int depth, char *fname) {
+    char *target = target_name(rule, fname);
+    double start = get_time();
+    int status;
+
+    // a rule runs at most once, whichever output was asked
+    if ((status = (intptr_t) hmap_get(&g_done, target))) {
+        free(target);
+        return status - 1 == JS_FAILED;
+    }
+
+    if (ev_begin("start")) {
+        ev_str("target", target);
+        ev_end();
+    }
+
+    status = run_rule(rule, depth, fname);
+    g_stats.targets++;
+
+    switch (status) {
+        case JS_BUILT:
+            g_stats.built++;
+            break;
+        case JS_UP_TO_DATE:
+            g_stats.up_to_date++;
+            if (!g_opt.quiet)
+                printf("June: %s: Up to date\n", target);
+            break;
+        case JS_NO_CMDS:
+            if (!g_opt.quiet)
+                printf("  No commands\n");
+            break;
+        case JS_FAILED:
+            g_stats.failed++;
+            break;
+    }
+
+    hmap_put(&g_done, target, (void *) (intptr_t) (status + 1));
+
+    if (ev_begin("finish")) {
+        char *names[] = {"built", "up_to_date", "no_commands", "failed"};
+        ev_str("target", target);
+        ev_str("status", names[status]);
+        ev_dbl("duration", get_time() - start);
+        ev_end();
+    }
+
+    free(target);
+    return status == JS_FAILED;
+}
+
+
+
+static int exec_rule(char *name) {
+    rule_t *rule = find_rule(name);
+
+    if (!rule)
+        return 1;
+
+    return exec_rule_rec(rule, 0, rule->name);
+}
+
+/*********************************
+ *                              *
+ *        Build Sharding        *
+ *                              *
+*********************************/
+
+/* --shard=i/n only runs the i-th of n slices of the leaf
+ * jobs, those whose dependencies are all plain files. Jobs
+ * are weighted by their duration in the --shard-log file,
+ * "seconds path" lines where the last one wins, and dealt
+ * longest first to the lightest shard. Runners must read the
+ * same file to compute the same partition: the --durations
+ * of every runner are appended to it between two rounds,
+ * and a last plain run over the gathered outputs does the rest
+*/
+
+typedef struct {
+    node_t *node;
+    double weight;
+    uint64_t hash;
+} job_t;
+
+static int job_cmp(const void *a, const void *b) {
+    const job_t *x = a, *y = b;
+
+    if (x->weight != y->weight)
+        return x->weight < y->weight ? 1 : -1;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return strcmp(x->node->target, y->node->target);
+}
+
+static int is_leaf_job(node_t *node) {
+    if (!node->rule || !node->rule->cmds)
+        return 0;
+
+    for (int i = 0; i < node->ndeps; i++) {
+        if (node->deps[i]->rule)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void load_weights(hmap_t *weights) {
+    // a missing file is a first round, every job weighs the same
+    char path[4096];
+    double seconds;
+    FILE *f;
+
+    if (!g_opt.shard_log || !(f = fopen(g_opt.shard_log, "re")))
+        return;
+
+    while (fscanf(f, "%lf %4095s", &seconds, path) == 2) {
+        double *w = malloc(sizeof(double));
+        *w = seconds;
+        free(hmap_get(weights, path));
+        hmap_put(weights, path, w);
+    }
+
+    fclose(f);
+}
+
+static int exec_shard(char **names) {
+    double total = 0, mine = 0, *load, *w;
+    int count = 0, known = 0, taken = 0, ret = 0;
+    hmap_t weights = {0};
+    job_t *jobs;
+    graph_t g;
+
+    load_weights(&weights);
+    graph_build(&g, names);
+    jobs = malloc(sizeof(job_t) * (g.count + 1));
+
+    for (int i = 0; i < g.count; i++) {
+        node_t *node = g.order[i];
+
+        if (!is_leaf_job(node))
+            continue;
+
+        w = hmap_get(&weights, node->target);
+        jobs[count].node = node;
+        jobs[count].weight = w ? *w : -1;
+        jobs[count].hash = hash_str(node->target);
+
+        if (jobs[count].weight >= 0) {
+            total += jobs[count].weight;
+            known++;
+        }
+        count++;
+    }
+
+    // jobs never run weigh as much as the average one
+    mine = known && total > 0 ? total / known : 1;
+
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].weight < 0) {
+            jobs[i].weight = mine;
+            total += mine;
+        }
+    }
+
+    qsort(jobs, count, sizeof(job_t), job_cmp);
+    load = calloc(g_opt.shards, sizeof(double));
+
+    for (int i = 0; i < count; i++) {
+        int best = 0;
+        for (int j = 1; j < g_opt.shards; j++) {
+            if (load[j] < load[best])
+                best = j;
+        }
+        load[best] += jobs[i].weight;
+        jobs[i].node->mark = best == g_opt.shard - 1;
+    }
+
+    mine = load[g_opt.shard - 1];
+
+    for (int i = 0; i < count; i++)
+        taken += jobs[i].node->mark;
+
+    if (g_opt.debug)
+        fprintf(stderr, "Shard %d/%d: %d of %d jobs, weight %.3f of %.3f\n\n",
+                g_opt.shard, g_opt.shards, taken, count, mine, total);
+
+    if (ev_begin("shard")) {
+        ev_int("index", g_opt.shard);
+        ev_int("count", g_opt.shards);
+        ev_int("jobs", taken);
+        ev_int("total_jobs", count);
+        ev_dbl("weight", mine);
+        ev_end();
+    }
+
+    // run them in build order
+    for (int i = 0; i < g.count && !ret; i++) {
+        if (g.order[i]->mark && is_leaf_job(g.order[i]))
+            ret = exec_rule_rec(g.order[i]->rule, 0, g.order[i]->fname);
+    }
+
+    free(load);
+    free(jobs);
+    graph_free(&g);
+    hmap_free(&weights, free);
+
+    return ret;
+}
+
+/*********************************
+ *                              *
+ *         Graph Export         *
+ *                              *
+*********************************/
+
+/* --emit hands the resolved graph to other tools without
+ * running anything. Each rule instance becomes one ninja
+ * edge with its recipes and $0 expanded, compile commands
+ * come from the same recipes
+*/
+
+static void ninja_str(FILE *f, char *str, int path) {
+    // paths also escape the separators of a build line
+    for (; *str; str++) {
+        if (*str == '$' || (path && (*str == ' ' || *str == ':')))
+            putc('$', f);
+        putc(*str, f);
+    }
+}
+
+static char *node_command(node_t *node) {
+    // june runs each recipe line in its own shell
+    rule_t *rule = node->rule;
+    strlist_t cmds = {0};
+    size_t len = 1;
+    char *res;
+
+    for (int i = 0; rule->cmds[i]; i++) {
+        list_push(&cmds, expend_var0(strdup(rule->cmds[i]), node->fname));
+        len += strlen(cmds.items[i]) + 6;
+    }
+
+    res = malloc(len);
+    *res = '\0';
+
+    for (int i = 0; i < cmds.count; i++) {
+        if (cmds.count == 1) {
+            strcat(res, cmds.items[i]);
+            break;
+        }
+        strcat(res, i ? " && (" : "(");
+        strcat(res, cmds.items[i]);
+        strcat(res, ")");
+    }
+
+    list_free(&cmds);
+    return res;
+}
+
+static int emit_ninja(graph_t *g, FILE *f) {
+    rule_t *def = g_rules;
+    int count = 0;
+
+    fprintf(f, "# generated by june from %s\n\n", g_opt.file);
+    fputs("rule june\n  command = $cmd\n  description = $out\n\n", f);
+
+    // ninja compares mtimes where june compares content hashes
+    fputs("rule june_restat\n  command = $cmd\n  description = $out\n  restat = 1\n", f);
+
+    for (int i = 0; i < g->count; i++) {
+        node_t *node = g->order[i];
+        char *single[] = {node->target, NULL};
+        char **outs;
+
+        if (!node->rule)
+            continue;
+
+        outs = node->rule->is_patern ? single : node->rule->outs;
+
+        fputs("\nbuild", f);
+        for (int j = 0; outs[j]; j++) {
+            putc(' ', f);
+            ninja_str(f, outs[j], 1);
+        }
+
+        if (!node->rule->cmds)
+            fputs(": phony", f);
+        else
+            fputs(node->rule->restat ? ": june_restat" : ": june", f);
+
+        for (int j = 0; j < node->ndeps; j++) {
+            putc(' ', f);
+            ninja_str(f, node->deps[j]->target, 1);
+        }
+        putc('\n', f);
+
+        if (node->rule->cmds) {
+            char *cmd = node_command(node);
+            fputs("  cmd = ", f);
+            ninja_str(f, cmd, 0);
+            putc('\n', f);
+            free(cmd);
+        }
+
+        count++;
+    }
+
+    while (def->name && def->is_patern)
+        def++;
+
+    if (def->name && hmap_get(&g->nodes, def->name)) {
+        fputs("\ndefault ", f);
+        ninja_str(f, def->name, 1);
+        putc('\n', f);
+    }
+
+    return count;
+}
+
+static int has_word(char *str, char *word) {
+    // strchr also matches the end of str
+    size_t len = strlen(word);
+
+    for (char *p = str; (p = strstr(p, word)); p++) {
+        if ((p == str || strchr(" \t'\"=", p[-1])) && strchr(" \t'\"", p[len]))
+            return 1;
+    }
+
+    return 0;
+}
+
+static char *compile_input(node_t *node, char *cmd) {
+    // the source of a patern instance, or the only input an
+    // explicit recipe names, link lines name several
+    char *found = NULL;
+
+    if (node->rule->is_patern)
+        return node->ndeps && has_word(cmd, node->deps[0]->target) ? node->deps[0]->target : NULL;
+
+    for (int i = 0; i < node->ndeps; i++) {
+        if (!has_word(cmd, node->deps[i]->target))
+            continue;
+        if (found)
+            return NULL;
+        found = node->deps[i]->target;
+    }
+
+    return found;
+}
+
+static int emit_compdb(graph_t *g, FILE *f) {
+    char *dir = realpath(g_opt.file, NULL);
+    int count = 0;
+
+    if (!dir) {
+        june_error("%s: Failed to resolve path", g_opt.file);
+        return -1;
+    }
+
+    // the jfile directory, "/" stays as is
+    *(strrchr(dir, '/') == dir ? dir + 1 : strrchr(dir, '/')) = '\0';
+
+    putc('[', f);
+
+    for (int i = 0; i < g->count; i++) {
+        node_t *node = g->order[i];
+
+        if (!node->rule || !node->rule->cmds)
+            continue;
+
+        for (int j = 0; node->rule->cmds[j]; j++) {
+            char *cmd = expend_var0(strdup(node->rule->cmds[j]), node->fname);
+            char *file = compile_input(node, cmd);
+
+            if (file) {
+                fputs(count++ ? ",\n  {\n    \"directory\": " : "\n  {\n    \"directory\": ", f);
+                json_str(f, dir);
+                fputs(",\n    \"command\": ", f);
+                json_str(f, cmd);
+                fputs(",\n    \"file\": ", f);
+                json_str(f, file);
+                fputs(",\n    \"output\": ", f);
+                json_str(f, node->target);
+                fputs("\n  }", f);
+            }
+
+            free(cmd);
+        }
+    }
+
+    fputs("\n]\n", f);
+    free(dir);
+
+    return count;
 }
 
-int exec_rule(char *name) {
-    rule_t *rule;
+/*********************************
+ *                              *
+ *      Library Interface       *
+ *                              *
+*********************************/
+
+/* each entry point makes its june_t current for the calling
+ * thread and restores the previous one before returning
+*/
+
+static pthread_once_t g_scan_once = PTHREAD_ONCE_INIT;
+
+june_t *june_new(juneopt_t *opt) {
+    june_t *june = calloc(1, sizeof(june_t));
+
+    pthread_once(&g_scan_once, scan_init);
+
+    if (opt)
+        june->opt = *opt;
+
+    june->stats.start = get_time();
+    june->rules = calloc(MAX_RULES, sizeof(rule_t));
+    june->vars = calloc(MAX_VARS, sizeof(var_t));
+    june->dirfd = -1;
+    june->backend = g_backends;
+    june->joblog.fd = 1;
+    june->errlog.fd = 2;
+    june->logname = strdup(JUNE_LOG);
+
+    return june;
+}
+
+static void free_list(void *list) {
+    list_free(list);
+    free(list);
+}
+
+void june_free(june_t *june) {
+    june_t *prev = g_june;
+    shared_t *sh;
+    int refs = 0;
+
+    g_june = june;
+    sh = june->shared;
+
+    free_globals();
+    hmap_free(&g_overrides, NULL);
+
+    if (g_backend->close)
+        g_backend->close();
+    if (g_dirfd != -1)
+        close(g_dirfd);
+
+    if (sh) {
+        pthread_mutex_lock(&sh->lock);
+        refs = --sh->refs;
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    if (sh && !refs) {
+        unmap_file(&sh->jf);
+        hmap_free(&sh->execs, free_list);
+        hmap_free(&sh->blocks, free_list);
+        list_free(&sh->names);
+        pthread_mutex_destroy(&sh->lock);
+        free(sh);
+    }
+
+    free(g_joblog.ring);
+    free(g_errlog.ring);
+    free(g_rules);
+    free(g_vars);
+    free(june->variant);
+    free(june->logname);
+    free(june);
+
+    g_june = prev;
+}
+
+static int load_jfile(int blocks) {
+    // interpret the shared jfile, overrides are already set
+    int ret = interp_file(&g_june->shared->jf, blocks);
+
+    if (ret || blocks)
+        return ret;
+
+    if (g_opt.debug) {
+        fprintf(stderr, "============ Variables ============\n\n");
+        for (int i = 0; g_vars[i].name; i++)
+            fprintf(stderr, "%s\t= %s\n", g_vars[i].name, get_var(g_vars[i].name));
+        fprintf(stderr, "\n============ Rules ============\n\n");
+        for (int i = 0; g_rules && g_rules[i].name; i++)
+            print_rule(g_rules + i);
+        fprintf(stderr, "================================\n\n");
+    }
+
+    index_rules();
+    log_load();
+
+    return 0;
+}
+
+int june_load(june_t *june, char *file) {
+    june_t *prev = g_june;
+    int ret = 1;
+
+    g_june = june;
+    g_opt.file = file ? file : JUNE_FILE;
+
+    g_june->shared = calloc(1, sizeof(shared_t));
+    pthread_mutex_init(&g_june->shared->lock, NULL);
+    g_june->shared->refs = 1;
+
+    set_var(strdup("VARIANT"), strdup(""), NULL);
+
+    if (open_jfile(g_opt.file, &g_june->shared->jf))
+        june_error("%s: Failed to open file", g_opt.file);
+    else
+        ret = load_jfile(g_opt.variants != NULL);
+
+    g_june = prev;
+    return ret;
+}
+
+static int set_override(char *line) {
+    char *name, *value, *str;
+
+    if (split_override(line, &name, &value)) {
+        june_error("'%s': Invalid variable override", line);
+        return 1;
+    }
+
+    // only VARIANT and earlier overrides are defined here
+    str = expand_vars(value, strlen(value), 0);
+    free(value);
+
+    if (!str) {
+        free(name);
+        return 1;
+    }
+
+    hmap_put(&g_overrides, name, (void *) 1);
+    set_var(name, str, NULL);
+
+    return 0;
+}
+
+june_t *june_variant(june_t *base, char *name, char **overrides) {
+    shared_t *sh = base->shared;
+    strlist_t *block = hmap_get(&sh->blocks, name);
+    june_t *prev = g_june, *june;
+    int ret = 0;
+
+    if (!is_valid_varname(name)) {
+        june_error("'%s': Invalid variant name", name);
+        return NULL;
+    }
+
+    if (!block && !(overrides && *overrides)) {
+        june_error("'%s': Variant not found", name);
+        return NULL;
+    }
+
+    june = june_new(&base->opt);
+    g_june = june;
+
+    june->variant = strdup(name);
+    june->dirfd = fcntl(base->dirfd, F_DUPFD_CLOEXEC, 0);
+    june->shared = sh;
+    g_opt.variant = june->variant;
+
+    free(g_logname);
+    g_logname = malloc(strlen(JUNE_LOG) + strlen(name) + 2);
+    sprintf(g_logname, "%s.%s", JUNE_LOG, name);
+
+    pthread_mutex_lock(&sh->lock);
+    sh->refs++;
+    pthread_mutex_unlock(&sh->lock);
+
+    set_var(strdup("VARIANT"), strdup(name), NULL);
+    hmap_put(&g_overrides, "VARIANT", (void *) 1);
+
+    for (int i = 0; !ret && block && i < block->count; i++)
+        ret = set_override(block->items[i]);
+
+    for (int i = 0; !ret && overrides && overrides[i]; i++)
+        ret = set_override(overrides[i]);
+
+    if (!ret)
+        ret = load_jfile(0);
+
+    g_june = prev;
+
+    if (ret) {
+        june_free(june);
+        return NULL;
+    }
+
+    return june;
+}
+
+char **june_variants(june_t *june) {
+    return june->shared ? june->shared->names.items : NULL;
+}
+
+static void build_reset(void) {
+    // a resident june_t must see the files as they are now
+    if (!g_june->builds++)
+        return;
+
+    memset(&g_stats, 0, sizeof(junestats_t));
+    g_stats.start = get_time();
+
+    hmap_free(&g_stat, NULL);
+    hmap_free(&g_dirs, NULL);
+    hmap_free(&g_files, free);
+    hmap_free(&g_done, NULL);
+    free(g_scan_ents);
+    g_scan_ents = NULL;
+}
+
+int june_build(june_t *june, char **rules) {
+    june_t *prev = g_june;
+    char *none[] = {NULL};
+    int ret = 0;
+
+    g_june = june;
+    rules = rules ? rules : none;
+    build_reset();
+
+    if (!g_opt.virtual)
+        scan_graph(rules);
+
+    if (g_opt.debug)
+        fprintf(stderr, "Scan: %d paths in %.3fs\n\n", g_stats.scanned, g_stats.scan_time);
+
+    if (g_opt.remote && !g_remote.in) {
+        g_backend = g_backends + 1;
+        if (g_backend->open(g_opt.remote)) {
+            june_error("%s: Failed to connect to the worker", g_opt.remote);
+            g_backend = g_backends;
+            ret = 1;
+        }
+    }
+
+    if (ret)
+        ;
+    else if (g_opt.shard)
+        ret = exec_shard(rules);
+    else if (!*rules)
+        ret = exec_rule(NULL);
+
+    // a shard only runs its slice, even of the named rules
+    for (int i = 0; !ret && !g_opt.shard && rules[i]; i++)
+        ret = exec_rule(rules[i]);
+
+    log_save();
+    g_stats.end = get_time();
+
+    g_june = prev;
+    return ret;
+}
+
+typedef struct {
+    june_t *june;
+    char **rules;
+    pthread_t thread;
+    int started;
+    int ret;
+} build_t;
+
+static void *build_thread(void *arg) {
+    build_t *build = arg;
+    build->ret = june_build(build->june, build->rules);
+    return NULL;
+}
+
+int june_build_many(june_t **junes, int count, char **rules, int *status) {
+    build_t *builds = calloc(count, sizeof(build_t));
+    int ret = 0;
+
+    for (int i = 0; i < count; i++) {
+        builds[i].june = junes[i];
+        builds[i].rules = rules;
+        builds[i].started = !pthread_create(&builds[i].thread, NULL, build_thread, builds + i);
+        if (!builds[i].started)
+            build_thread(builds + i);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (builds[i].started)
+            pthread_join(builds[i].thread, NULL);
+        if (status)
+            status[i] = builds[i].ret;
+        ret |= builds[i].ret;
+    }
+
+    free(builds);
+    return ret;
+}
+
+int june_plan(june_t *june, char **rules, june_cb_t cb, void *arg) {
+    // a target runs if it is out of date or if a dependency runs
+    june_t *prev = g_june;
+    char *none[] = {NULL};
+    graph_t g;
+
+    g_june = june;
+    build_reset();
+    graph_build(&g, rules ? rules : none);
+
+    for (int i = 0; i < g.count; i++) {
+        node_t *node = g.order[i];
+
+        if (!node->rule)
+            continue;
+
+        for (int j = 0; j < node->ndeps && !node->mark; j++)
+            node->mark = node->deps[j]->mark;
+
+        if (!node->mark && !is_up_to_date(node->fname, node->rule))
+            node->mark = 1;
+
+        if (node->mark && node->rule->cmds)
+            cb(node->target, arg);
+    }
+
+    graph_free(&g);
+
+    g_june = prev;
+    return 0;
+}
+
+int june_emit(june_t *june, char *format, char **rules) {
+    // no rules for every explicit rule of the jfile
+    june_t *prev = g_june;
+    char *name = NULL;
+    int count = -1;
+    graph_t g;
+    FILE *f;
+
+    g_june = june;
+
+    if (!strcmp(format, "ninja"))
+        name = "build.ninja";
+    else if (!strcmp(format, "compile_commands"))
+        name = "compile_commands.json";
 
     if (!name) {
-        rule = g_rules;
-        while (rule->is_patern)
-            rule++;
-        if (!rule->name) {
-            fprintf(stderr, "June: No default rule found\n");
+        june_error("'%s': Invalid emit format, expected ninja or compile_commands", format);
+        g_june = prev;
+        return 1;
+    }
+
+    for (int i = 0; rules && rules[i]; i++) {
+        if (!find_rule(rules[i])) {
+            g_june = prev;
             return 1;
         }
+    }
+
+    build_reset();
+    graph_build(&g, rules && *rules ? rules : NULL);
+
+    if (!(f = june_fopen(name, "w"))) {
+        june_error("%s: Failed to open file", name);
     } else {
-        rule = NULL;
-        for (int i = 0; g_rules[i].name; i++) {
-            if (!strcmp(g_rules[i].name, name) && !g_rules[i].is_patern) {
-                rule = g_rules + i;
-                break;
-            }
+        count = *format == 'n' ? emit_ninja(&g, f) : emit_compdb(&g, f);
+        if (fclose(f) && count >= 0) {
+            june_error("%s: Failed to write file", name);
+            count = -1;
         }
-        if (!rule) {
-            fprintf(stderr, "June: '%s': Rule not found\n", name);
-            return 1;
+    }
+
+    if (count >= 0 && !g_opt.quiet)
+        printf("June: %s: %d entries\n", name, count);
+
+    graph_free(&g);
+
+    g_june = prev;
+    return count < 0;
+}
+
+int june_affected(june_t *june, char **paths, june_cb_t cb, void *arg) {
+    june_t *prev = g_june;
+    int ret;
+
+    g_june = june;
+    ret = list_affected(paths, cb, arg);
+
+    g_june = prev;
+    return ret;
+}
+
+void june_summary(june_t *june, int status) {
+    june_t *prev = g_june;
+    double elapsed;
+
+    g_june = june;
+
+    // variants are summed up once all of them are done
+    elapsed = (g_stats.end ? g_stats.end : get_time()) - g_stats.start;
+
+    if (g_opt.quiet) {
+        printf("June: %s%s%d targets, %d built, %d up to date, %d failed (%d commands, %.2fs, scan %.2fs)\n",
+                g_opt.variant ? g_opt.variant : "", g_opt.variant ? ": " : "", g_stats.targets, g_stats.built, g_stats.up_to_date,
+                g_stats.failed, g_stats.commands, elapsed, g_stats.scan_time);
+    }
+
+    if (g_opt.remote && g_opt.debug) {
+        fprintf(stderr, "Remote: %d inputs uploaded, %d already on the worker\n",
+                g_stats.uploaded, g_stats.deduped);
+    }
+
+    if (g_stats.unchanged && !g_opt.quiet) {
+        printf("June: %d outputs unchanged, %d dependent targets skipped\n",
+                g_stats.unchanged, g_stats.cutoff);
+    }
+
+    if (ev_begin("summary")) {
+        ev_int("targets", g_stats.targets);
+        ev_int("built", g_stats.built);
+        ev_int("up_to_date", g_stats.up_to_date);
+        ev_int("failed", g_stats.failed);
+        ev_int("commands", g_stats.commands);
+        ev_int("unchanged", g_stats.unchanged);
+        ev_int("cutoff", g_stats.cutoff);
+        ev_dbl("scan_time", g_stats.scan_time);
+        if (g_opt.remote) {
+            ev_int("uploaded", g_stats.uploaded);
+            ev_int("deduped", g_stats.deduped);
         }
+        ev_int("status", status);
+        ev_dbl("duration", elapsed);
+        ev_end();
     }
 
-    return exec_rule_rec(rule, 0, rule->name);
+    g_june = prev;
 }
 
 /*********************************
@@ -877,26 +4462,145 @@ int exec_rule(char *name) {
  *                              *
 *********************************/
 
-void print_help(void) {
+#ifndef JUNE_NO_MAIN
+
+static FILE *open_events(char *dest) {
+    // dest is either a file descriptor number or a file name
+    char *end;
+    long fd = strtol(dest, &end, 10);
+    FILE *f;
+
+    if (*dest && *end == '\0')
+        f = fdopen(fd, "w");
+    else
+        f = fopen(dest, "we");
+
+    // events are written in big chunks, never line by line
+    if (f)
+        setvbuf(f, NULL, _IOFBF, 1 << 16);
+
+    return f;
+}
+
+static void print_help(void) {
     puts(JUNE_USAGE "Options:\n"
         "  -h    Print this message\n"
         "  -v    Print version\n"
         "  -n    Do not use file system\n"
         "  -f    Specify the file to interpret\n"
         "  -d    Print debug informations\n"
+        "  -q    Only print a summary of the build\n"
+        "  --events=<fd|file>\n"
+        "        Write NDJSON build events to a file descriptor or a file\n"
+        "  --variant=<name>[:VAR=value;...]\n"
+        "        Build a variant with overrides, 'all' for every @variant\n"
+        "  --emit=<ninja|compile_commands>\n"
+        "        Write build.ninja or compile_commands.json without running recipes\n"
+        "  --affected <paths...>\n"
+        "        Print the targets depending on the given files, in build order\n"
+        "  --shard=<i>/<n>\n"
+        "        Only run the i-th of n balanced slices of the leaf jobs\n"
+        "  --shard-log=<file>\n"
+        "        Weigh the shards by the durations in a file shared by every runner\n"
+        "  --durations=<file>\n"
+        "        Write the duration of each job run, the runners' files append to --shard-log\n"
+        "  --remote=<socket>\n"
+        "        Run the recipes, one at a time, on the june worker listening on a Unix socket,\n"
+        "        only declared inputs and outputs are shipped: list headers as deps\n"
+        "  --worker=<socket>\n"
+        "        Serve recipes on a Unix socket, also started as june-worker <socket>\n"
     );
 }
 
-void paseargs(int argc, char **argv) {
+static void parse_longopt(char *arg, juneopt_t *opt) {
+    if (!strncmp(arg, "--events=", 9)) {
+        if (opt->events) {
+            fprintf(stderr, "June: Events output already specified\n" JUNE_USAGE);
+            exit(1);
+        }
+        if (!(opt->events = open_events(arg + 9))) {
+            fprintf(stderr, "June: %s: Failed to open events output\n", arg + 9);
+            exit(1);
+        }
+        return;
+    }
+
+    if (!strncmp(arg, "--shard=", 8)) {
+        char c;
+        if (sscanf(arg + 8, "%d/%d%c", &opt->shard, &opt->shards, &c) != 2 ||
+                opt->shard < 1 || opt->shard > opt->shards) {
+            fprintf(stderr, "June: %s: Invalid shard, expected i/n with 1 <= i <= n\n", arg + 8);
+            exit(1);
+        }
+        return;
+    }
+
+    if (!strncmp(arg, "--shard-log=", 12)) {
+        opt->shard_log = arg + 12;
+        return;
+    }
+
+    if (!strncmp(arg, "--durations=", 12)) {
+        if (opt->durations) {
+            fprintf(stderr, "June: Durations output already specified\n" JUNE_USAGE);
+            exit(1);
+        }
+        if (!(opt->durations = fopen(arg + 12, "we"))) {
+            fprintf(stderr, "June: %s: Failed to open durations output\n", arg + 12);
+            exit(1);
+        }
+        return;
+    }
+
+    if (!strncmp(arg, "--remote=", 9)) {
+        opt->remote = arg + 9;
+        return;
+    }
+
+    if (!strncmp(arg, "--worker=", 9)) {
+        opt->worker = arg + 9;
+        return;
+    }
+
+    if (!strncmp(arg, "--variant=", 10)) {
+        int count = 0;
+        while (opt->variants && opt->variants[count])
+            count++;
+        opt->variants = realloc(opt->variants, sizeof(char *) * (count + 2));
+        opt->variants[count] = arg + 10;
+        opt->variants[count + 1] = NULL;
+        return;
+    }
+
+    if (!strncmp(arg, "--emit=", 7)) {
+        opt->emit = arg + 7;
+        return;
+    }
+
+    if (!strcmp(arg, "--affected")) {
+        opt->affected = 1;
+        return;
+    }
+
+    fprintf(stderr, "June: Invalid option %s\n" JUNE_USAGE, arg);
+    exit(1);
+}
+
+static void paseargs(int argc, char **argv, juneopt_t *opt) {
     int i = 1;
 
-    memset(&g_opt, 0, sizeof(juneopt_t));
+    memset(opt, 0, sizeof(juneopt_t));
 
     while (i < argc) {
         if (argv[i][0] != '-') {
             break;
         }
 
+        if (argv[i][1] == '-') {
+            parse_longopt(argv[i++], opt);
+            continue;
+        }
+
         if (strlen(argv[i]) != 2) {
             fprintf(stderr, "June: Invalid option %s\n" JUNE_USAGE, argv[i]);
             exit(1);
@@ -910,21 +4614,24 @@ void paseargs(int argc, char **argv) {
                 puts(JUNE_VERSION);
                 exit(0);
             case 'n':
-                g_opt.virtual = 1;
+                opt->virtual = 1;
                 break;
             case 'd':
-                g_opt.debug = 1;
+                opt->debug = 1;
+                break;
+            case 'q':
+                opt->quiet = 1;
                 break;
             case 'f':
                 if (i + 1 >= argc) {
                     fprintf(stderr, "June: Missing argument for option 'f'\n" JUNE_USAGE);
                     exit(1);
                 }
-                if (g_opt.file) {
+                if (opt->file) {
                     fprintf(stderr, "June: File already specified\n" JUNE_USAGE);
                     exit(1);
                 }
-                g_opt.file = argv[++i];
+                opt->file = argv[++i];
                 break;
             default:
                 fprintf(stderr, "June: Invalid option -- '%c'\n" JUNE_USAGE, argv[i][1]);
@@ -934,59 +4641,114 @@ void paseargs(int argc, char **argv) {
         i++;
     }
 
-    if (g_opt.file == NULL)
-        g_opt.file = JUNE_FILE;
-    g_opt.rules = argv + i;
+    if (opt->file == NULL)
+        opt->file = JUNE_FILE;
+    opt->rules = argv + i;
 }
 
-#define main_error() {ret = 1; goto main_end;}
-
-int main(int argc, char **argv) {
-    paseargs(argc, argv);
-
-    g_rules = calloc(MAX_RULES, sizeof(rule_t));
-    g_vars = calloc(MAX_VARS, sizeof(var_t));
+static int build_variants(june_t *base, juneopt_t *opt) {
+    // --variant=name[:VAR=value;...], all variants build at once
+    june_t **junes = NULL;
+    int count = 0, ret = 0;
+
+    for (int i = 0; opt->variants[i] && !ret; i++) {
+        char *arg = strdup(opt->variants[i]);
+        char *sets = strchr(arg, ':');
+        char **names = june_variants(base);
+        char **overrides = NULL;
+        char *all[] = {arg, NULL};
+
+        if (sets) {
+            *sets = '\0';
+            overrides = str_split(sets + 1, ';');
+        }
 
-    FILE *f = chdir_and_open(g_opt.file, "r");
+        if (strcmp(arg, "all") || sets || !names)
+            names = all;
 
-    int ret = 0;
+        for (int j = 0; names[j] && !ret; j++) {
+            junes = realloc(junes, sizeof(june_t *) * (count + 1));
+            if (!(junes[count] = june_variant(base, names[j], overrides)))
+                ret = 1;
+            else
+                count++;
+        }
 
-    if (!f) {
-        printf("June: %s: Failed to open file\n", g_opt.file);
-        main_error();
+        for (int j = 0; overrides && overrides[j]; j++)
+            free(overrides[j]);
+        free(overrides);
+        free(arg);
     }
 
-    if (interp_file(f)) {
-        fclose(f);
-        main_error();
+    if (!ret) {
+        int *status = malloc(sizeof(int) * (count + 1));
+        ret = june_build_many(junes, count, opt->rules, status);
+        for (int i = 0; i < count; i++)
+            june_summary(junes[i], status[i]);
+        free(status);
     }
 
-    fclose(f);
+    for (int i = 0; i < count; i++)
+        june_free(junes[i]);
 
-    if (g_opt.debug) {
-        fprintf(stderr, "============ Variables ============\n\n");
-        for (int i = 0; g_vars[i].name; i++)
-            fprintf(stderr, "%s\t= %s\n", g_vars[i].name, g_vars[i].value);
-        fprintf(stderr, "\n============ Rules ============\n\n");
-        for (int i = 0; g_rules && g_rules[i].name; i++)
-            print_rule(g_rules + i);
-        fprintf(stderr, "================================\n\n");
+    free(junes);
+    return ret;
+}
+
+static void print_target(const char *target, void *arg) {
+    (void) arg;
+    puts(target);
+}
+
+int main(int argc, char **argv) {
+    char *base = strrchr(argv[0], '/');
+    juneopt_t opt;
+    june_t *june;
+    int ret;
+
+    if (!strcmp(base ? base + 1 : argv[0], "june-worker")) {
+        if (argc != 2) {
+            fprintf(stderr, "Usage: june-worker <socket>\n");
+            return 1;
+        }
+        return worker_main(argv[1]);
     }
 
-    if (*g_opt.rules) {
-        for (int i = 0; g_opt.rules[i]; i++)
-            if (exec_rule(g_opt.rules[i]))
-                main_error();
+    paseargs(argc, argv, &opt);
+
+    if (opt.worker)
+        return worker_main(opt.worker);
+
+    // --affected and --emit read the jfile without variants
+    if (opt.affected || opt.emit) {
+        free(opt.variants);
+        opt.variants = NULL;
     }
 
-    else if (exec_rule(NULL))
-        main_error();
+    june = june_new(&opt);
+    ret = june_load(june, opt.file);
 
-    main_end:
+    if (!ret && opt.affected)
+        ret = june_affected(june, opt.rules, print_target, NULL);
+    else if (!ret && opt.emit)
+        ret = june_emit(june, opt.emit, opt.rules);
+    else if (!ret && opt.variants)
+        ret = build_variants(june, &opt);
+    else if (!ret)
+        ret = june_build(june, opt.rules);
 
-    free_globals();
-    free(g_rules);
-    free(g_vars);
+    if (!opt.affected && !opt.emit && !opt.variants)
+        june_summary(june, ret);
+
+    june_free(june);
+    free(opt.variants);
+
+    if (opt.events)
+        fclose(opt.events);
+    if (opt.durations)
+        fclose(opt.durations);
 
     return ret;
 }
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef JUNE_H
+#define JUNE_H
+
+#include <stdio.h>
+
+/* libjune: build june.c with -DJUNE_NO_MAIN to embed it,
+ * only the june_ functions below are exported.
+ * A june_t holds everything about one jfile, several of
+ * them can be used at once from different threads, but a
+ * june_t must only be used by one thread at a time
+*/
+
+typedef struct june june_t;
+
+typedef struct {
+    int virtual;
+    int debug;
+    int quiet;
+    int affected;
+    int shard;          // 1-based, 0 when not sharding
+    int shards;
+    char *shard_log;    // shared "seconds path" weights
+    FILE *durations;    // owned by the caller, job durations
+    char *remote;       // worker socket
+    char *worker;       // socket to serve on
+    char *variant;      // set by june_variant
+    char **variants;    // --variant arguments, NULL terminated
+    char *emit;         // --emit format
+    char *file;
+    char **rules;
+    FILE *events;       // owned by the caller
+} juneopt_t;
+
+typedef void (*june_cb_t)(const char *target, void *arg);
+
+// opt is copied, NULL for the defaults
+june_t *june_new(juneopt_t *opt);
+void june_free(june_t *june);
+
+// parse the jfile, paths are then relative to its directory,
+// with opt.variants set only its @variant blocks are read:
+// variables may then be defined by the variants alone
+int june_load(june_t *june, char *file);
+
+// the same jfile with the variable overrides of a variant:
+// its @variant block then overrides, "NAME = value" each
+june_t *june_variant(june_t *base, char *name, char **overrides);
+
+// names of the @variant blocks of the jfile, NULL if none
+char **june_variants(june_t *june);
+
+// rules are NULL terminated, empty for the default rule
+int june_build(june_t *june, char **rules);
+
+// build every june_t at once, each in its own thread,
+// status receives their results if not NULL
+int june_build_many(june_t **junes, int count, char **rules, int *status);
+
+// targets a build would run, in order, without running them
+int june_plan(june_t *june, char **rules, june_cb_t cb, void *arg);
+
+// write build.ninja or compile_commands.json next to the
+// jfile, format is "ninja" or "compile_commands"
+int june_emit(june_t *june, char *format, char **rules);
+
+// targets depending on paths, in build order
+int june_affected(june_t *june, char **paths, june_cb_t cb, void *arg);
+
+// summary line and event of the last build
+void june_summary(june_t *june, int status);
+
+#endif
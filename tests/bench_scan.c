@@ -0,0 +1,87 @@
+/* scan microbenchmark, from the repository root:
+ *   gcc -O2 -o bench_scan tests/bench_scan.c -lpthread
+ * a 1 MiB line of ~25-byte dependency names, split and
+ * validated then searched for '$' and blanked, for each
+ * scan implementation the CPU supports
+*/
+
+#define JUNE_NO_MAIN
+#include "../june.c"
+
+#define BENCH_SIZE (1 << 20)
+#define BENCH_ROUNDS 20
+
+char *bench_line(void) {
+    char *line = malloc(BENCH_SIZE + 1);
+    size_t len = 0;
+
+    for (int n = 0; len + 32 < BENCH_SIZE; n++)
+        len += sprintf(line + len, "src/module_%06d/file.c ", n);
+
+    while (len < BENCH_SIZE)
+        line[len++] = ' ';
+    line[len] = '\0';
+
+    return line;
+}
+
+double bench_split(char *line) {
+    double start = get_time();
+    size_t count = 0;
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        char **names = str_split(line, ' ');
+        for (int i = 0; names[i]; i++) {
+            count += is_valid_filename(names[i]);
+            free(names[i]);
+        }
+        free(names);
+    }
+
+    if (!count)
+        puts("no names");
+
+    return BENCH_SIZE * (double) BENCH_ROUNDS / (get_time() - start) / 1e6;
+}
+
+double bench_dollar(char *line) {
+    double start = get_time();
+    size_t found = 0;
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        found += g_scan(line, BENCH_SIZE, SK_CHAR, '$', 0);
+        g_blank(line, BENCH_SIZE);
+    }
+
+    if (found != (size_t) BENCH_SIZE * BENCH_ROUNDS)
+        puts("unexpected '$'");
+
+    return BENCH_SIZE * (double) BENCH_ROUNDS / (get_time() - start) / 1e6;
+}
+
+void bench(char *name, char *line,
+        size_t (*scan)(const char *, size_t, int, char, int),
+        void (*blank)(char *, size_t)) {
+    g_scan = scan;
+    g_blank = blank;
+
+    printf("%-7s split+validate %6.0f MB/s   $-search+blank %6.0f MB/s\n",
+            name, bench_split(line), bench_dollar(line));
+}
+
+int main(void) {
+    char *line = bench_line();
+
+    bench("scalar", line, scalar_scan, scalar_blank);
+
+    #ifdef JUNE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        bench("sse2", line, sse2_scan, sse2_blank);
+    if (__builtin_cpu_supports("avx2"))
+        bench("avx2", line, avx2_scan, avx2_blank);
+    #endif
+
+    free(line);
+    return 0;
+}
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+# the graph of --emit=ninja must match june's own rebuild
+# decisions: ninja's mtime rules are applied to build.ninja
+# and compared with the targets june builds, on a clean
+# tree, a no-op run and after touching one source
+#   tests/emit_check.py [path to june]
+
+import json, os, re, shutil, subprocess, sys, tempfile, time
+
+TESTS = os.path.dirname(os.path.abspath(__file__))
+JUNE = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else os.path.join(TESTS, '..', 'june'))
+
+# copied files, jfile, file to touch, rules to build
+CASES = [
+    (['../demo/jfile', '../demo/src'], 'jfile', 'src/main.c', ['test', 'list']),
+    (['sub.jn'], 'sub.jn', 'sub5', ['all']),
+    (['multi.jn'], 'multi.jn', 'gen.h', ['all']),
+    (['chain.jn', 'chain.y'], 'chain.jn', 'chain.y', ['all']),
+]
+
+def unescape(word):
+    return re.sub(r'\$(.)', r'\1', word)
+
+def words(text):
+    return [unescape(w) for w in re.split(r'(?<!\$) ', text) if w]
+
+def ninja_dirty(root):
+    # targets of the edges ninja would run, without a .ninja_log
+    edges, producer, memo = [], {}, {}
+
+    for line in open(os.path.join(root, 'build.ninja')):
+        if line.startswith('build '):
+            outs, rest = re.split(r'(?<!\$):', line[6:].rstrip('\n'), 1)
+            rest = words(rest)
+            edge = (words(outs), rest[0], rest[1:])
+            edges.append(edge)
+            for out in edge[0]:
+                producer[out] = edge
+
+    def mtime(path):
+        # june compares whole seconds
+        path = os.path.join(root, path)
+        return int(os.stat(path).st_mtime) if os.path.exists(path) else None
+
+    def dirty(edge):
+        key = id(edge)
+        if key not in memo:
+            res = any(i in producer and dirty(producer[i]) for i in edge[2])
+            if edge[1] != 'phony':
+                outs = [mtime(o) for o in edge[0]]
+                if None in outs or any(mtime(i) is None or mtime(i) > min(outs) for i in edge[2]):
+                    res = True
+            memo[key] = res
+        return memo[key]
+
+    return sorted(e[0][0] for e in edges if e[1] != 'phony' and dirty(e))
+
+def june_built(root, jfile, rules):
+    events = os.path.join(root, 'events.json')
+    subprocess.run([JUNE, '-q', '-f', jfile, '--events=' + events] + rules,
+            cwd=root, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    built = set()
+    for line in open(events):
+        ev = json.loads(line)
+        if ev['event'] == 'finish' and ev['status'] == 'built':
+            built.add(ev['target'])
+    return sorted(built)
+
+def check(files, jfile, touch, rules):
+    root = tempfile.mkdtemp()
+    ok = True
+
+    for name in files:
+        src = os.path.join(TESTS, name)
+        dst = os.path.join(root, os.path.basename(name))
+        if os.path.isdir(src):
+            shutil.copytree(src, dst)
+        else:
+            shutil.copy(src, dst)
+
+    for step in ('clean', 'noop', 'touch'):
+        if step == 'touch':
+            time.sleep(1)
+            open(os.path.join(root, touch), 'a').close()
+            os.utime(os.path.join(root, touch))
+
+        subprocess.run([JUNE, '-q', '-f', jfile, '--emit=ninja'], cwd=root,
+                stdout=subprocess.DEVNULL, check=True)
+        want = ninja_dirty(root)
+        got = june_built(root, jfile, rules)
+
+        print('%-9s %-5s %s' % (jfile, step, 'ok' if want == got else 'DIFF'))
+        if want != got:
+            print('  ninja %s\n  june  %s' % (want, got))
+            ok = False
+
+    shutil.rmtree(root)
+    return ok
+
+if __name__ == '__main__':
+    sys.exit(0 if all([check(*case) for case in CASES]) else 1)
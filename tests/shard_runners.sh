@@ -0,0 +1,73 @@
+#!/bin/sh
+# runners of --shard=i/3, each on its own copy of the tree,
+# over two rounds: the first without history, the second
+# weighted by the durations of the first appended to the
+# shared --shard-log. In each round the slices must be
+# disjoint and cover every job, a runner must get the same
+# slice again, and the second round must be balanced
+#   tests/shard_runners.sh [path to june]
+
+june=$(realpath "${1:-$(dirname "$0")/../june}")
+tmp=$(mktemp -d)
+fail=0
+
+# job k sleeps k tenths of a second
+for k in 1 2 3 4 5 6; do
+    printf 'job%d:\n    sleep 0.%d\n    touch job%d\n\n' $k $k $k
+done > "$tmp/jfile"
+printf 'all: job1 job2 job3 job4 job5 job6\n    touch all\n' >> "$tmp/jfile"
+
+runner() {
+    # runner <round> <i> <copy>: the jobs it ran, on stdout
+    dir="$tmp/r$1.$2.$3"
+    mkdir "$dir" && cp "$tmp/jfile" "$dir/jfile"
+    (cd "$dir" && "$june" -q --shard="$2"/3 --shard-log="$tmp/weights" \
+        --durations="$tmp/d$1.$2.$3" all > /dev/null) || echo "runner $2 failed" >&2
+    ls "$dir" | grep '^job' | sort
+}
+
+check_round() {
+    for i in 1 2 3; do
+        runner "$1" $i 1 > "$tmp/s$1.$i" &
+    done
+    wait
+
+    for i in 1 2 3; do
+        if ! runner "$1" $i 2 | cmp -s - "$tmp/s$1.$i"; then
+            echo "round $1: runner $i got another slice"
+            fail=1
+        fi
+        echo "round $1: runner $i:" $(cat "$tmp/s$1.$i")
+    done
+
+    if ! sort "$tmp/s$1".* | uniq -d | cmp -s - /dev/null; then
+        echo "round $1: slices overlap"
+        fail=1
+    fi
+    if [ "$(cat "$tmp/s$1".* | wc -l)" -ne 6 ]; then
+        echo "round $1: slices do not cover the jobs"
+        fail=1
+    fi
+}
+
+check_round 1
+cat "$tmp"/d1.*.1 >> "$tmp/weights"
+check_round 2
+
+# 0.6 0.5 0.4 0.3 0.2 0.1 deal to 0.7 seconds each
+for i in 1 2 3; do
+    sum=$(sed 's/job//' "$tmp/s2.$i" | awk '{ s += $1 } END { print s }')
+    if [ "$sum" -ne 7 ]; then
+        echo "round 2: runner $i has $sum tenths, expected 7"
+        fail=1
+    fi
+done
+
+# only the restat log may be written next to the jfile
+if ls -a "$tmp"/r* | grep -q june_log; then
+    echo "a runner wrote a .june_log"
+    fail=1
+fi
+
+rm -rf "$tmp"
+exit $fail
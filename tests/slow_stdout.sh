@@ -0,0 +1,44 @@
+#!/bin/sh
+# a slow stdout consumer must not slow the recipes down:
+# the recipe duration from the event stream stays the same
+# when june's output is read 64 KiB every 10 ms
+#   tests/slow_stdout.sh [path to june]
+
+cd "$(dirname "$0")" || exit 1
+june=$(realpath "${1:-../june}")
+events=$(mktemp)
+out=$(mktemp)
+
+duration() {
+    sed -n 's/.*"event":"command".*"duration":\([0-9.]*\).*/\1/p' "$events"
+}
+
+slow_reader() {
+    python3 -c '
+import sys, time
+while sys.stdin.buffer.read1(65536):
+    time.sleep(0.01)
+'
+}
+
+"$june" -q -f output.jn --events="$events" > /dev/null
+fast=$(duration)
+
+"$june" -f output.jn --events="$events" | tee "$out" | slow_reader
+slow=$(duration)
+
+# the whole output still gets through, byte for byte
+seq 1 200000 > "$events.ref"
+grep -v '^seq ' "$out" | cmp -s - "$events.ref"
+same=$?
+
+rm -f "$events" "$events.ref" "$out" .june_log
+
+echo "recipe: ${fast}s with /dev/null, ${slow}s with a slow reader"
+if [ $same -ne 0 ]; then
+    echo "output differs"
+    exit 1
+fi
+
+# fail when the slow reader made the recipe 5 times slower
+awk -v f="$fast" -v s="$slow" 'BEGIN { exit !(s < f * 5 + 0.05) }'